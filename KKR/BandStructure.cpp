@@ -1,90 +1,113 @@
 #include "BandStructure.h"
 
 #include "ChemUtils.h"
+#include "RootFinding.h"
 
 namespace KKR
 {
-	void BandStructure::SetPotential(Potential& potential, int numerovGridNodes, double Rp, double deltaGrid)
+	void BandStructure::SetPotential(Potential& potential, const RadialGrid& grid)
 	{
+		const size_t numerovGridNodes = grid.GetSize();
+
 		potential.m_potentialValues.resize(numerovGridNodes);
-		for (int i = 0; i < numerovGridNodes; ++i)
+		for (size_t i = 0; i < numerovGridNodes; ++i)
 		{
 			//const double r = i * dr; // for uniform grid
-			const double r = Rp * (exp(i * deltaGrid) - 1.); // for non uniform grid
+			const double r = grid.GetPosition(i); // for non uniform grid
 			potential.m_potentialValues[i] = -Pseudopotential::VeffCu(r) / r;
 		}
 	}
 
-	void BandStructure::ComputeSchrodinger(std::vector<std::future<void>>& tasks, Potential& potential, std::vector<std::vector<double>>& ratios, int numIntervals, int numerovGridNodes, int numerovIntervals, double deltaGrid, double minE, double dE, int lMax, const std::atomic_bool& terminate, const Options& options)
+	void BandStructure::ComputePhaseShifts(ThreadPool& pool, std::vector<PhaseShiftTable>& phaseShifts, const Potential& potential, const RadialGrid& grid, double minE, double maxE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const
 	{
-		std::launch launchType = options.nrThreads == 1 ? std::launch::deferred : std::launch::async;
+		phaseShifts.resize(lMax + 1LL);
+
+		// the error of the angle that gives the logarithmic derivative, well below the tolerance for the band energies
+		const double tolerance = 0.01 * options.tolerance;
 
-		int startPos = 0;
-		int step = ceil(static_cast<double>(numIntervals) / options.nrThreads);
-		if (step < 1) step = 1;
-		int nextPos;
+		// a task for each l
+		pool.ParallelFor(0, lMax + 1, 1, [this, &phaseShifts, &potential, &grid, minE, maxE, tolerance, &terminate](int startPos, int nextPos)
+			{
+				Numerov<NumerovFunctionNonUniformGrid> numerov(potential, grid);
 
-		for (int t = 0; t < options.nrThreads; ++t, startPos = nextPos)
+				for (int l = startPos; l < nextPos && !terminate; ++l)
+					phaseShifts[l].Compute(numerov, numerovIntervals, m_Rmax, l, minE, maxE, phaseShiftStep, tolerance);
+			}
+		);
+	}
+
+	void BandStructure::ComputeSchrodinger(const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, std::vector<std::vector<double>>& ratios, int startPos, int nextPos, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const
+	{
+		if (!phaseShifts.empty())
 		{
-			if (t == options.nrThreads - 1) nextPos = numIntervals;
-			else nextPos = startPos + step;
+			Numerov<NumerovFunctionNonUniformGrid> numerov(potential, grid);
 
-			if (nextPos > numIntervals) nextPos = numIntervals;
+			// interpolated, solved only if the table has a gap there
+			for (int posE = startPos; posE < nextPos && !terminate; ++posE)
+			{
+				const double E = minE + posE * dE;
 
-			tasks[t] = std::async(launchType, [this, &potential, numerovGridNodes, &ratios, startPos, nextPos, minE, dE, lMax, numerovIntervals, deltaGrid, &terminate]()->void
+				ratios[posE].resize(lMax + 1LL);
+				for (int l = 0; l <= lMax; ++l)
 				{
-					//Numerov<NumerovFunctionRegularGrid> numerov(potential, 0, m_Rmax, numerovGridNodes);
-					Numerov<NumerovFunctionNonUniformGrid> numerov(potential, deltaGrid, m_Rmax, numerovGridNodes);
-
-					for (int posE = startPos; posE < nextPos && !terminate; ++posE)
+					ratios[posE][l] = phaseShifts[l].GetRatio(E);
+					if (isnan(ratios[posE][l]))
 					{
-						const double E = minE + posE * dE;
-
-						ratios[posE].resize(lMax + 1LL);
-						for (int l = 0; l <= lMax && !terminate; ++l)
-						{
-							// first parameter: pass m_Rmax for uniform grid, pass numerovIntervals for non-uniform (in this case the step is 1, so max radius is numerovIntervals)
-							ratios[posE][l] = numerov.SolveSchrodinger(/*m_Rmax*/numerovIntervals, l, E, numerovIntervals);
-						}
+						numerov.SolveSchrodingerForAllL(numerovIntervals, lMax, E, numerovIntervals, ratios[posE]);
+						break;
 					}
 				}
-			);
+			}
 		}
+		else if (options.logDerivative)
+		{
+			LogDerivativeNumerov<NumerovFunctionNonUniformGrid> numerov(potential, grid);
 
-		for (auto& task : tasks)
-			task.get();
-	}
-
-	std::vector<std::vector<double>> BandStructure::Compute(const std::atomic_bool& terminate, const Options& options)
-	{
-		const double minE = -0.05;
-		const double maxE = 0.8;
+			for (int posE = startPos; posE < nextPos && !terminate; ++posE)
+				numerov.SolveSchrodingerForAllL(numerovIntervals, lMax, minE + posE * dE, numerovIntervals, ratios[posE]);
+		}
+		else
+		{
+			//Numerov<NumerovFunctionRegularGrid> numerov(potential, grid);
+			Numerov<NumerovFunctionNonUniformGrid> numerov(potential, grid);
 
-		const double dE = 1E-3;
-		const int numerovIntervals = 2000;
-		const int numIntervals = static_cast<int>((maxE - minE) / dE);
+			// several energies are solved together, in a single pass over the grid
+			double energies[numerovBatchSize];
+			for (int posE = startPos; posE < nextPos && !terminate; posE += numerovBatchSize)
+			{
+				const int nrEnergies = std::min(numerovBatchSize, nextPos - posE);
+				for (int e = 0; e < nrEnergies; ++e)
+					energies[e] = minE + (posE + e) * dE;
 
-		const int numerovGridNodes = numerovIntervals + 1;
+				// first parameter: pass m_Rmax for uniform grid, pass numerovIntervals for non-uniform (in this case the step is 1, so max radius is numerovIntervals)
+				numerov.SolveSchrodingerBatch(/*m_Rmax*/numerovIntervals, lMax, energies, nrEnergies, numerovIntervals, &ratios[posE]);
+			}
+		}
+	}
 
-		const double dr = m_Rmax / numerovIntervals;
+	std::vector<std::vector<double>> BandStructure::Compute(const std::atomic_bool& terminate, const ComputeOptions& options)
+	{
+		const double minE = options.minE;
+		const double maxE = options.maxE;
 
-		const size_t lMax = 2; // this is high enough for this toy program
+		double dE = energyStep;
+		int numIntervals = static_cast<int>((maxE - minE) / dE);
 
-		// the limits depend on energy step and lMax
-		double smallMinLimit = 1E5;
-		double detLim = 1E50;
-		double ctgLimit = 1E-4;
-		if (3 == lMax)
+		// the adaptive mode scans on a coarser grid, with the same ends
+		// a window with less than two grid points has no coarser grid
+		if (options.adaptive && !options.tracking && options.coarseSteps > 1 && numIntervals >= 2)
 		{
-			smallMinLimit = 1E27;
-			detLim = 1E70;
-			ctgLimit = 5 * 1E-5;
+			const double lastE = minE + (numIntervals - 1LL) * dE;
+			numIntervals = static_cast<int>(ceil((lastE - minE) / (dE * options.coarseSteps))) + 1;
+			dE = (lastE - minE) / (numIntervals - 1LL);
 		}
 
+		const int numerovGridNodes = numerovIntervals + 1;
+
+		const int lMax = m_lMax;
 
-		// the following two are needed for the non-uniform grid computations
-		const double deltaGrid = 0.005;
-		const double Rp = m_Rmax / (exp(numerovIntervals * deltaGrid) - 1.);
+		// the non-uniform grid, shared by all the radial computations
+		const RadialGrid grid(m_Rmax, deltaGrid, numerovGridNodes);
 
 		std::vector<std::vector<double>> res;
 		std::vector<std::vector<double>> ratios(numIntervals);
@@ -92,76 +115,546 @@ namespace KKR
 		// First, compute psi'/psi at muffin boundary, for each energy
 
 		Potential potential;
-		SetPotential(potential, numerovGridNodes, Rp, deltaGrid);
+		SetPotential(potential, grid);
+
+		// the threads are started only for the first computation or if their number changed
+		m_threadPool.SetThreads(options.nrThreads);
+
+		// the Ewald sums are tuned for the energy window, including the grid step more at the ends, or the defaults are used
+		// the lattice vectors and their spherical harmonics are generated again only if the parameters changed since the last computation
+		const EwaldParameters ewald = options.ewaldTolerance > 0 ? TuneEwaldParameters(minE - dE, minE + numIntervals * dE, options.ewaldTolerance) : EwaldParameters(GetCellVolume());
+		if (ewald != m_ewald)
+			SetEwaldParameters(ewald);
+
+		// optionally, the radial equation is solved on an adaptive energy grid and interpolated everywhere else
+		// the table covers a grid step more at the ends, for the refinements close to them
+		std::vector<PhaseShiftTable> phaseShifts;
+		if (options.phaseShiftTable)
+		{
+			ComputePhaseShifts(m_threadPool, phaseShifts, potential, grid, minE - dE, minE + numIntervals * dE, lMax, terminate, options);
+
+			if (terminate) return res;
+		}
+
+		// the k independent parts of the structure constants, computed once for each energy
+		std::vector<EwaldEnergyTerms> energyTerms(numIntervals);
 
-		std::vector<std::future<void>> tasks(options.nrThreads);
+		// the windows of the energy grid are queued first, so the threads that are free take them in order
+		EnergyWindows windows(m_threadPool, numIntervals, energiesPerTask);
+		for (int window = 0; window < windows.GetCount(); ++window)
+		{
+			const int startPos = windows.GetStart(window);
+			const int nextPos = std::min(startPos + energiesPerTask, numIntervals);
+
+			m_threadPool.Submit(windows.GetGroup(window), [this, &potential, &grid, &phaseShifts, &ratios, &energyTerms, startPos, nextPos, minE, dE, lMax, &terminate, &options]()
+				{
+					ComputeSchrodinger(potential, grid, phaseShifts, ratios, startPos, nextPos, minE, dE, lMax, terminate, options);
+					ComputeEnergyTerms(energyTerms, ratios, startPos, nextPos, minE, dE, lMax, terminate);
+				}
+			);
+		}
 
-		ComputeSchrodinger(tasks, potential, ratios, numIntervals, numerovGridNodes, numerovIntervals, deltaGrid, minE, dE, lMax, terminate, options);
+		// now compute the spectrum for each k point along the path, overlapped with the above
+		std::exception_ptr exception;
+		try
+		{
+			ComputeBandstructure(m_threadPool, windows, res, ratios, energyTerms, potential, grid, phaseShifts, numIntervals, minE, dE, lMax, terminate, options);
+		}
+		catch (...)
+		{
+			exception = std::current_exception();
+		}
 
-		if (terminate) return res;
+		// the k point tasks might not have needed all of them, or might have been terminated or failed, but the windows use the local data
+		windows.WaitForAll();
 
-		// now compute the spectrum for each k point along the path
-		ComputeBandstructure(tasks, res, ratios, numIntervals, minE, dE, lMax, terminate, options, smallMinLimit, detLim, ctgLimit);
+		if (exception)
+			std::rethrow_exception(exception);
 
 		return res;
 	}
 
-	void BandStructure::ComputeBandstructure(std::vector<std::future<void>>& tasks, std::vector<std::vector<double>>& res, std::vector<std::vector<double>>& ratios, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const Options& options, double smallMinLimit, double detLim, double ctgLimit) const
+	void BandStructure::ComputeEnergyTerms(std::vector<EwaldEnergyTerms>& energyTerms, const std::vector<std::vector<double>>& ratios, int startPos, int nextPos, double minE, double dE, int lMax, const std::atomic_bool& terminate) const
+	{
+		const LambdaBase lambda(basisLattice, realLattice, realHarmonics, m_Rmax, GetCellVolume(), m_ewald, lMax);
+
+		for (int posE = startPos; posE < nextPos && !terminate; ++posE)
+		{
+			// the energies where the radial solution blew up are skipped anyway
+			if (IsBlowup(ratios, posE, lMax, terminate)) continue;
+
+			energyTerms[posE] = lambda.ComputeEnergyTerms(minE + posE * dE);
+		}
+	}
+
+	void BandStructure::ComputeBandstructure(ThreadPool& pool, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const
 	{
 		res.resize(kpoints.size());
 
-		CG::Coefficients coeffs;
-		coeffs.PrecalculateCoefficients(lMax);
+		pool.ParallelFor(0, static_cast<int>(kpoints.size()), kPointsPerTask, [this, numIntervals, minE, dE, lMax, &windows, &ratios, &res, &energyTerms, &potential, &grid, &phaseShifts, &options, &terminate](int startPos, int nextPos)
+			{
+				ComputeKPoints(startPos, nextPos, windows, res, ratios, energyTerms, potential, grid, phaseShifts, numIntervals, minE, dE, lMax, terminate, options);
+			}
+		);
+	}
+
+	namespace {
+
+		// computes the determinant at any energy, solving the radial equation for it
+		// used by the adaptive modes to refine the band energies between the grid points and for the Newton steps
+		class DeterminantFunction
+		{
+		public:
+			// if the phase shift tables are not empty, the ratios are interpolated from them, the radial equation is solved only outside them
+			// with logDerivative the values are solved with the renormalized Numerov method, the derivatives always need the solution itself
+			DeterminantFunction(Lambda& lambda, const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, int numerovIntervals, int lMax, bool logDerivative)
+				: m_lambda(lambda), m_numerov(potential, grid), m_logDerivativeNumerov(potential, grid), m_logDerivative(logDerivative), m_phaseShifts(phaseShifts), m_numerovIntervals(numerovIntervals), m_ratios(lMax + 1LL), m_ratioDerivatives(lMax + 1LL)
+			{
+			}
+
+			void SetKPoint(const Vector3D<double>& k) { m_k = k; }
+
+			LogDeterminant operator()(double E)
+			{
+				if (!Solve(E)) return LogDeterminant();
+
+				return m_lambda.LogDet();
+			}
+
+			// d ln|det| / dE, from the analytic derivative of the matrix, NaN if the radial equation cannot be solved at E
+			double LogDerivative(double E)
+			{
+				if (!Interpolate(E, true))
+				{
+					for (int l = 0; l < static_cast<int>(m_ratios.size()); ++l)
+					{
+						m_ratios[l] = m_numerov.SolveSchrodinger(m_numerovIntervals, l, E, m_numerovIntervals, m_ratioDerivatives[l]);
+						if (isnan(m_ratios[l]) || isinf(m_ratios[l]))
+							return std::numeric_limits<double>::quiet_NaN();
+					}
+				}
+
+				m_lambda.ComputeWithDerivative(E, m_k, m_ratios, m_ratioDerivatives);
+				if (!m_lambda.LogDet().IsValid())
+					return std::numeric_limits<double>::quiet_NaN();
+
+				return m_lambda.LogDetDerivative();
+			}
+
+			// false if the radial equation cannot be solved at E
+			bool Eigenvalues(double E, Lambda::RealVector& eigenvalues)
+			{
+				if (!Solve(E)) return false;
+
+				eigenvalues = m_lambda.Eigenvalues();
+
+				return true;
+			}
+
+			// the ratios for the last energy passed to operator()
+			const std::vector<double>& GetRatios() const { return m_ratios; }
+
+		private:
+			bool Solve(double E)
+			{
+				// unlike on the grid, large ratios are not skipped, the root search needs values close to the poles, too
+				if (!Interpolate(E, false))
+				{
+					if (m_logDerivative)
+						m_logDerivativeNumerov.SolveSchrodingerForAllL(m_numerovIntervals, static_cast<unsigned int>(m_ratios.size() - 1), E, m_numerovIntervals, m_ratios);
+					else
+						m_numerov.SolveSchrodingerForAllL(m_numerovIntervals, static_cast<unsigned int>(m_ratios.size() - 1), E, m_numerovIntervals, m_ratios);
+
+					for (const double ratio : m_ratios)
+						if (isnan(ratio) || isinf(ratio))
+							return false;
+				}
+
+				m_lambda.Compute(E, m_k, m_ratios);
+
+				return true;
+			}
+
+			// false if there are no tables or E is not covered by them
+			bool Interpolate(double E, bool derivatives)
+			{
+				if (m_phaseShifts.empty()) return false;
+
+				for (int l = 0; l < static_cast<int>(m_ratios.size()); ++l)
+				{
+					m_ratios[l] = derivatives ? m_phaseShifts[l].GetRatio(E, m_ratioDerivatives[l]) : m_phaseShifts[l].GetRatio(E);
+					if (isnan(m_ratios[l]) || isinf(m_ratios[l]))
+						return false;
+				}
+
+				return true;
+			}
+
+			Lambda& m_lambda;
+			Numerov<NumerovFunctionNonUniformGrid> m_numerov;
+			LogDerivativeNumerov<NumerovFunctionNonUniformGrid> m_logDerivativeNumerov;
+			const bool m_logDerivative;
+			const std::vector<PhaseShiftTable>& m_phaseShifts;
+			const int m_numerovIntervals;
+
+			Vector3D<double> m_k;
+			std::vector<double> m_ratios;
+			std::vector<double> m_ratioDerivatives;
+		};
 
-		int step = ceil(static_cast<double>(kpoints.size()) / options.nrThreads);
-		if (step < 1) step = 1;
-		int nextPos;
+	}
 
-		std::launch launchType = options.nrThreads == 1 ? std::launch::deferred : std::launch::async;
+	void BandStructure::ComputeKPoints(int startPos, int nextPos, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const
+	{
+		Lambda lambda(basisLattice, realLattice, realHarmonics, m_Rmax, GetCellVolume(), m_ewald, lMax);
+		DeterminantFunction determinant(lambda, potential, grid, phaseShifts, numerovIntervals, lMax, options.logDerivative);
+
+		if (options.energyMajor && !options.tracking && !options.adaptive)
+		{
+			ScanEnergyMajor(startPos, nextPos, lambda, determinant, windows, res, ratios, energyTerms, numIntervals, minE, dE, lMax, terminate, options);
+			return;
+		}
 
-		for (int t = 0, startPos = 0; t < options.nrThreads; ++t, startPos = nextPos)
+		// loop over k points
+		for (int k = startPos; k < nextPos && !terminate; ++k)
 		{
-			if (t == options.nrThreads - 1) nextPos = kpoints.size();
-			else nextPos = startPos + step;
+			LogDeterminant olderDet;
+			LogDeterminant oldDet;
+			double oldE = minE;
 
-			if (nextPos > kpoints.size()) nextPos = kpoints.size();
+			determinant.SetKPoint(kpoints[k]);
 
-			tasks[t] = std::async(launchType, [this, startPos, nextPos, numIntervals, minE, dE, lMax, smallMinLimit, detLim, ctgLimit, &ratios, &res, &coeffs, &terminate]()->void
+			if (options.tracking)
+			{
+				TrackKPoint(res[k], lambda, determinant, kpoints[k], windows, ratios, energyTerms, numIntervals, minE, dE, lMax, terminate, options.tolerance);
+				continue;
+			}
+
+			// loop over all energies
+			for (int posE = 0; posE < numIntervals && !terminate; ++posE)
+			{
+				// a window skipped because of termination doesn't have the ratios
+				windows.WaitFor(posE);
+				if (terminate) break;
+
+				const double E = minE + posE * dE;
+
+				if (IsBlowup(ratios, posE, lMax, terminate))
 				{
-					Lambda lambda(basisVectors, realVectors, m_Rmax, m_a * m_a * m_a / 4., lMax);
+					// the adaptive mode goes over it, the interval is refined anyway
+					if (!options.adaptive)
+						oldDet = olderDet = LogDeterminant();
 
-					// loop over k points
-					for (int k = startPos; k < nextPos && !terminate; ++k)
-					{
-						double olderDet = 0;
-						double oldDet = 0;
+					continue;
+				}
 
-						// loop over all energies
-						for (int posE = 0; posE < numIntervals && !terminate; ++posE)
-						{
-							const double E = minE + posE * dE;
+				lambda.Compute(E, kpoints[k], ratios[posE], energyTerms[posE]);
 
-							if (IsBlowup(ratios, posE, lMax, terminate))
-							{
-								oldDet = olderDet = std::numeric_limits<double>::infinity();
-								continue;
-							}
+				const LogDeterminant det = lambda.LogDet();
 
-							lambda.Compute(E, kpoints[k], ratios[posE], coeffs);
+				if (options.adaptive)
+				{
+					if (det.IsValid() && oldDet.IsValid())
+						RefineInterval(res[k], determinant, lambda, oldE, E, oldDet, det, options.tolerance);
+				}
+				else
+				{
+					const int multiplicity = GetResult(res, ratios, lambda, k, E, posE, dE, det, oldDet, olderDet);
+					if (multiplicity && options.newton)
+						res[k].back() = NewtonRefine(determinant, res[k].back(), E - multiplicity * dE, E, multiplicity, options.tolerance);
+				}
 
-							const double det = lambda.Determinant().real();
+				olderDet = oldDet;
+				oldDet = det;
+				oldE = E;
+			}
+		}
+	}
 
-							GetResult(res, ratios, lambda, k, E, posE, dE, det, oldDet, olderDet, detLim, ctgLimit, smallMinLimit, lMax);
-							olderDet = oldDet;
-							oldDet = det;
-						}
-					}
+	template<class DeterminantFunction> void BandStructure::ScanEnergyMajor(int startPos, int nextPos, Lambda& lambda, DeterminantFunction& determinant, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const
+	{
+		const int nrKPoints = nextPos - startPos;
+
+		// the terms that depend only on k, for all the k points, they are used for each energy
+		std::vector<EwaldKPointTerms> kTerms;
+		kTerms.reserve(nrKPoints);
+		for (int k = startPos; k < nextPos; ++k)
+			kTerms.emplace_back(lambda.ComputeKPointTerms(kpoints[k]));
+
+		std::vector<LogDeterminant> olderDets(nrKPoints);
+		std::vector<LogDeterminant> oldDets(nrKPoints);
+
+		// loop over all energies
+		for (int posE = 0; posE < numIntervals && !terminate; ++posE)
+		{
+			// a window skipped because of termination doesn't have the ratios
+			windows.WaitFor(posE);
+			if (terminate) break;
+
+			if (IsBlowup(ratios, posE, lMax, terminate))
+			{
+				std::fill(oldDets.begin(), oldDets.end(), LogDeterminant());
+				std::fill(olderDets.begin(), olderDets.end(), LogDeterminant());
+
+				continue;
+			}
+
+			const double E = minE + posE * dE;
+
+			// loop over k points, the ratios and the energy terms are the same for all
+			for (int i = 0; i < nrKPoints; ++i)
+			{
+				const int k = startPos + i;
+
+				lambda.Compute(E, kTerms[i], ratios[posE], energyTerms[posE]);
+
+				const LogDeterminant det = lambda.LogDet();
+
+				const int multiplicity = GetResult(res, ratios, lambda, k, E, posE, dE, det, oldDets[i], olderDets[i]);
+				if (multiplicity && options.newton)
+				{
+					determinant.SetKPoint(kpoints[k]);
+					res[k].back() = NewtonRefine(determinant, res[k].back(), E - multiplicity * dE, E, multiplicity, options.tolerance);
 				}
-			);
+
+				olderDets[i] = oldDets[i];
+				oldDets[i] = det;
+			}
+		}
+	}
+
+	template<class DeterminantFunction> void BandStructure::RefineInterval(std::vector<double>& res, DeterminantFunction& determinant, const LambdaBase& lambda, double Ea, double Eb, const LogDeterminant& detA, const LogDeterminant& detB, double tolerance) const
+	{
+		// if the factorization could not give the count, fall back to the sign change, as for the scan on the grid
+		const int nrRoots = detA.HasInertia() && detB.HasInertia() ? detB.negative - detA.negative : (detA.sign != detB.sign ? 1 : 0);
+
+		if (lambda.HasPole(Ea, Eb))
+		{
+			// the poles decrease the count, so the intervals between them are refined separately
+			// the determinant blows up close to a pole, so a small neighbourhood of each is skipped
+			double E = Ea;
+			LogDeterminant det = detA;
+			for (const double pole : lambda.GetPoles(Ea, Eb))
+			{
+				const double poleWidth = PoleWidth(pole, tolerance);
+				const double Ep = pole - poleWidth;
+				if (Ep > E && det.IsValid())
+				{
+					const LogDeterminant detP = determinant(Ep);
+					if (detP.IsValid())
+						RefineInterval(res, determinant, lambda, E, Ep, det, detP, tolerance);
+				}
+
+				E = pole + poleWidth;
+				if (E >= Eb) return;
+
+				det = determinant(E);
+			}
+
+			if (det.IsValid())
+				RefineInterval(res, determinant, lambda, E, Eb, det, detB, tolerance);
+
+			return;
+		}
+		else if (nrRoots < 0)
+		{
+			// should not happen without a pole, bisect a few times, then give up
+			if (Eb - Ea <= 0.25 * energyStep) return;
+		}
+		else if (0 == nrRoots) return;
+		else if (1 == nrRoots)
+		{
+			// a single root, so the sign changes, too
+			// only the sign and the ratios matter, so the values can be scaled to avoid overflow
+			const double logRef = std::max(detA.logAbs, detB.logAbs);
+			auto scaled = [&determinant, logRef](double E) -> double
+			{
+				return determinant(E).Scaled(logRef);
+			};
+
+			const double root = RootFinding::Brent(scaled, Ea, Eb, detA.Scaled(logRef), detB.Scaled(logRef), tolerance);
+			if (isnan(root)) return;
+
+			// a pole of the phase shift cotangent increases the count and changes the sign, too
+			// close to a root the determinant increases going away from it, close to a pole it decreases
+			// the poles were isolated above, so the roots close to them are not skipped, as they are for the scan on the grid
+			const LogDeterminant val = determinant(root);
+			if (0 == val.sign) return;
+
+			const double step = std::min(1000. * tolerance, 0.5 * std::max(root - Ea, Eb - root));
+			const LogDeterminant neighbour = determinant(root - Ea > Eb - root ? root - step : root + step);
+			if (!neighbour.IsValid() || val.logAbs < neighbour.logAbs)
+				res.push_back(root);
+
+			return;
+		}
+		else if (Eb - Ea <= tolerance)
+		{
+			// a degenerate root, it's reported once, as for the scan on the grid
+			res.push_back(0.5 * (Ea + Eb));
+			return;
+		}
+
+		// bisect until there is at most a root in each interval
+		// if the radial equation cannot be solved in the middle, try a little aside
+		double Em = 0.5 * (Ea + Eb);
+		LogDeterminant detM = determinant(Em);
+		if (!detM.IsValid())
+		{
+			Em = 0.4 * Ea + 0.6 * Eb;
+			detM = determinant(Em);
+			if (!detM.IsValid()) return;
 		}
 
-		for (auto& task : tasks)
-			task.get();
+		RefineInterval(res, determinant, lambda, Ea, Em, detA, detM, tolerance);
+		RefineInterval(res, determinant, lambda, Em, Eb, detM, detB, tolerance);
+	}
+
+	template<class DeterminantFunction> void BandStructure::TrackKPoint(std::vector<double>& res, Lambda& lambda, DeterminantFunction& determinant, const Vector3D<double>& k, const EnergyWindows& windows, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, double tolerance) const
+	{
+		using RealVector = Lambda::RealVector;
+
+		RealVector oldVals;
+		RealVector olderVals;
+		double oldE = 0;
+		double olderE = 0;
+		int nrVals = 0; // how many of the above are valid
+
+		RealVector vals;
+		int posE = 0;
+		while (posE < numIntervals && !terminate)
+		{
+			windows.WaitFor(posE);
+			if (terminate) break;
+
+			if (IsBlowup(ratios, posE, lMax, terminate))
+			{
+				// goes over it, the interval is refined anyway
+				++posE;
+				continue;
+			}
+
+			const double E = minE + posE * dE;
+
+			lambda.Compute(E, k, ratios[posE], energyTerms[posE]);
+			vals = lambda.Eigenvalues();
+
+			if (nrVals)
+				RefineEigenvalues(res, determinant, lambda, oldE, E, oldVals, vals, tolerance);
+
+			olderVals = oldVals;
+			olderE = oldE;
+			oldVals = vals;
+			oldE = E;
+			if (nrVals < 2) ++nrVals;
+
+			// the next step goes just over the closest predicted crossing of zero, using the slopes from the last step
+			// the eigenvalues are not tracked through a crossing, they are sorted, so the index does not follow a band
+			// but that doesn't matter, it's only for the step size
+			int step = maxTrackingSteps;
+			if (nrVals > 1)
+			{
+				for (int i = 0; i < vals.size(); ++i)
+				{
+					const double slope = (vals(i) - olderVals(i)) / (E - olderE);
+					if (vals(i) * slope >= 0) continue; // going away from zero
+
+					const double distance = -vals(i) / slope;
+					if (distance < step * dE)
+						step = static_cast<int>(ceil(distance / dE));
+				}
+			}
+
+			// the last point of the grid is not skipped
+			if (posE == numIntervals - 1) break;
+			posE = std::min(posE + std::max(step, 1), numIntervals - 1);
+		}
+	}
+
+	template<class DeterminantFunction> void BandStructure::RefineEigenvalues(std::vector<double>& res, DeterminantFunction& determinant, const LambdaBase& lambda, double Ea, double Eb, const Lambda::RealVector& valsA, const Lambda::RealVector& valsB, double tolerance) const
+	{
+		using RealVector = Lambda::RealVector;
+
+		if (lambda.HasPole(Ea, Eb))
+		{
+			// an eigenvalue goes through infinity at the pole, so the intervals between poles are refined separately
+			RealVector vals;
+			double E = Ea;
+			bool valid = true;
+			for (const double pole : lambda.GetPoles(Ea, Eb))
+			{
+				const double poleWidth = PoleWidth(pole, tolerance);
+				const double Ep = pole - poleWidth;
+				if (Ep > E && valid)
+				{
+					RealVector valsP;
+					if (determinant.Eigenvalues(Ep, valsP))
+						RefineEigenvalues(res, determinant, lambda, E, Ep, E == Ea ? valsA : vals, valsP, tolerance);
+				}
+
+				E = pole + poleWidth;
+				if (E >= Eb) return;
+
+				valid = determinant.Eigenvalues(E, vals);
+			}
+
+			if (valid)
+				RefineEigenvalues(res, determinant, lambda, E, Eb, vals, valsB, tolerance);
+
+			return;
+		}
+
+		// the eigenvalues decrease with energy between the poles, the ones with the index in [nA, nB) crossed zero
+		const int nA = static_cast<int>((valsA.array() < 0).count());
+		const int nB = static_cast<int>((valsB.array() < 0).count());
+
+		if (nB < nA)
+		{
+			// should not happen without a pole, bisect a few times, then give up, as for the determinant
+			if (Eb - Ea <= 0.25 * energyStep) return;
+
+			const double Em = 0.5 * (Ea + Eb);
+			RealVector valsM;
+			if (!determinant.Eigenvalues(Em, valsM)) return;
+
+			RefineEigenvalues(res, determinant, lambda, Ea, Em, valsA, valsM, tolerance);
+			RefineEigenvalues(res, determinant, lambda, Em, Eb, valsM, valsB, tolerance);
+
+			return;
+		}
+
+		// kept for all the evaluations, so they don't allocate
+		RealVector vals;
+		for (int n = nA; n < nB; ++n)
+		{
+			auto eigenvalue = [&determinant, &vals, n](double E) -> double
+			{
+				if (!determinant.Eigenvalues(E, vals)) return std::numeric_limits<double>::quiet_NaN();
+
+				return vals(n);
+			};
+
+			const double root = RootFinding::Brent(eigenvalue, Ea, Eb, valsA(n), valsB(n), tolerance);
+			if (isnan(root)) continue;
+
+			// a pole of the phase shift cotangent also increases the count, but there the eigenvalue jumps from +infinity to -infinity
+			// and the index does not follow it, so Brent converges to a discontinuity where the value is not small
+			// compared with the slope on the same side, which is the slope of a single branch
+			const double val = eigenvalue(root);
+			if (isnan(val)) continue;
+			else if (val != 0)
+			{
+				const double step = std::min(100. * tolerance, 0.5 * (Eb - Ea));
+				const double Es = val > 0 ? std::max(root - step, Ea) : std::min(root + step, Eb);
+				const double slope = abs(eigenvalue(Es) - val) / abs(Es - root);
+				if (!(abs(val) <= 10. * tolerance * slope)) continue;
+			}
+
+			// degenerate bands cross zero together, they are reported once, as for the other modes
+			if (!res.empty() && root - res.back() < tolerance) continue;
+
+			res.push_back(root);
+		}
 	}
 
 	bool BandStructure::IsBlowup(const std::vector<std::vector<double>>& ratios, double posE, int lMax, const std::atomic_bool& terminate)
@@ -179,43 +672,69 @@ namespace KKR
 		return blowup;
 	}
 
-	void BandStructure::GetResult(std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double olderDet, double detLim, double ctgLimit, double smallMinLimit, int lMax) const
+	int BandStructure::GetResult(std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const LambdaBase& lambda, int k, double E, int posE, double dE, const LogDeterminant& det, const LogDeterminant& oldDet, const LogDeterminant& olderDet) const
 	{
 		if (IsChangeInSign(posE, det, oldDet)) // change in sign
 		{
-			// skip over the poles of 'free' Green function, they create issues
-			if (IsOverLimits(ratios, lambda, k, E, posE, dE, det, oldDet, detLim, ctgLimit))
+			// skip over the poles of 'free' Green function and of the phase shift cotangent, they change the sign, too
+			// the minimum of |det| for a double root below cannot come from the phase shift pole, which makes |det| large
+			if (!lambda.IsCloseToPole(E, kpoints[k], 2 * dE) && !lambda.HasPhaseShiftPole(E - dE, ratios[posE - 1LL], E, ratios[posE]))
 			{
-				res[k].push_back(LinearInterpolation(E, dE, det, oldDet));
+				// only the ratio of the values matters for interpolation, so they can be scaled to avoid overflow
+				const double logRef = std::max(det.logAbs, oldDet.logAbs);
+				res[k].push_back(LinearInterpolation(E, dE, det.Scaled(logRef), oldDet.Scaled(logRef)));
+
+				return 1;
 			}
 		}
-		else if (IsOverLimits2(ratios, lambda, k, E, posE, dE, det, oldDet, olderDet, detLim, ctgLimit, smallMinLimit, lMax))
+		else if (posE > 1 && IsDoubleRoot(det, oldDet, olderDet) && !lambda.IsCloseToPole(E, kpoints[k], 2 * dE))
 		{
-			res[k].push_back(QuadraticInterpolation(E, dE, det, oldDet, olderDet));
+			const double logRef = std::max(det.logAbs, olderDet.logAbs);
+			res[k].push_back(QuadraticInterpolation(E, dE, det.Scaled(logRef), oldDet.Scaled(logRef), olderDet.Scaled(logRef)));
+
+			return 2;
 		}
+
+		return 0;
 	}
 
-	bool BandStructure::IsOverLimits(const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double detLim, double ctgLimit) const
+	template<class DeterminantFunction> double BandStructure::NewtonRefine(DeterminantFunction& determinant, double E, double Ea, double Eb, int multiplicity, double tolerance)
 	{
-		return !isnan(det) && !isnan(oldDet) && !isinf(det) && !isinf(oldDet) && (abs(det) < detLim && abs(oldDet) < detLim) &&
-			!lambda.IsCloseToPole(E, kpoints[k], 2 * dE, ratios[posE], ctgLimit);
-	}
+		double root = E;
+		for (int iter = 0; iter < maxNewtonIterations; ++iter)
+		{
+			// det / det' = 1 / (ln |det|)', for a root with the multiplicity m the step is m times larger
+			const double logDerivative = determinant.LogDerivative(root);
+			if (!std::isfinite(logDerivative) || 0 == logDerivative) break;
+
+			const double step = multiplicity / logDerivative;
+			root -= step;
 
+			// it went out of the bracket, or there is no root, as for a minimum of the determinant that doesn't reach zero
+			if (root < Ea || root > Eb) break;
+			else if (abs(step) < tolerance) return root;
+		}
+
+		return E;
+	}
 
-	bool BandStructure::IsOverLimits2(const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double olderDet, double detLim, double ctgLimit, double smallMinLimit, int lMax) const
+	bool BandStructure::IsDoubleRoot(const LogDeterminant& det, const LogDeterminant& oldDet, const LogDeterminant& olderDet)
 	{
-		return posE > 1 && !isnan(det) && !isnan(oldDet) && !isnan(olderDet) && !isinf(det) && !isinf(oldDet) && !isinf(olderDet) &&
-			abs(det) < detLim && abs(olderDet) < detLim &&
-			abs(oldDet) < abs(olderDet) && abs(oldDet) < abs(det) && // went over a minimum
-			abs(oldDet) < ((abs(E) > 0.3 && 3 == lMax) ? 1E-8 : 1) * smallMinLimit && // the minimum must be 'small' - for lMax = 3 I had to use this hack for high energy
-			((olderDet < 0 && oldDet < 0 && det < 0) || (olderDet > 0 && oldDet > 0 && det > 0)) && // all have the same sign, otherwise the sign change should be detected
-			!lambda.IsCloseToPole(E, kpoints[k], 2 * dE, ratios[posE], ctgLimit);
+		// two roots closer than the energy step (or a degenerate one) do not change the sign, but they create a minimum of |det|
+		// a smooth minimum of |det| that is not a root has a log |det| with a second difference close to zero,
+		// for (E - E0)^2 it's 2 ln((dE^2 - x^2) / x^2), x being the distance from the middle point to E0, so a near degenerate pair is still caught
+		const double minSecondDifference = 0.5;
+
+		return det.IsValid() && oldDet.IsValid() && olderDet.IsValid() &&
+			olderDet.sign == oldDet.sign && oldDet.sign == det.sign && // all have the same sign, otherwise the sign change should be detected
+			oldDet.logAbs < olderDet.logAbs && oldDet.logAbs < det.logAbs && // went over a minimum
+			det.logAbs + olderDet.logAbs - 2. * oldDet.logAbs > minSecondDifference; // the minimum must be sharp
 	}
 
 
-	bool BandStructure::IsChangeInSign(double posE, double det, double oldDet)
+	bool BandStructure::IsChangeInSign(int posE, const LogDeterminant& det, const LogDeterminant& oldDet)
 	{
-		return posE > 0 && det * oldDet < 0;
+		return posE > 0 && det.IsValid() && oldDet.IsValid() && det.sign != oldDet.sign;
 	}
 
 
@@ -2,17 +2,21 @@
 
 #include <vector>
 #include <atomic>
-#include <future>
+#include <memory>
+#include <exception>
 
 #include "Lambda.h"
 
 #include "Vector3D.h"
 
-#include "Options.h"
+#include "ComputeOptions.h"
 
 #include "BandStructureBasis.h"
 #include "Numerov.h"
+#include "LogDerivativeNumerov.h"
+#include "PhaseShiftTable.h"
 #include "Pseudopotential.h"
+#include "ThreadPool.h"
 
 namespace KKR
 {
@@ -32,28 +36,127 @@ namespace KKR
 
 		std::vector<std::vector<double>> results;
 
-		void Initialize(std::vector<std::string> path, unsigned int nrPoints = 600) override
+		void Initialize(std::vector<std::string> path, unsigned int nrPoints = 600, unsigned int lMax = 2) override
 		{
-			BandStructureBasis::Initialize(path, nrPoints);
+			BandStructureBasis::Initialize(path, nrPoints, lMax);
 			results.clear();
 		};
 
 
-		std::vector<std::vector<double>> Compute(const std::atomic_bool& terminate, const Options& options);
+		std::vector<std::vector<double>> Compute(const std::atomic_bool& terminate, const ComputeOptions& options);
+
+		static void SetPotential(Potential& potential, const RadialGrid& grid);
 
 	private:
-		void ComputeSchrodinger(std::vector<std::future<void>>& tasks, Potential& potential, std::vector<std::vector<double>>& ratios, int numIntervals, int numerovGridNodes, int numerovIntervals, double deltaGrid, double minE, double dE, int lMax, const std::atomic_bool& terminate, const Options& options);
-		void ComputeBandstructure(std::vector<std::future<void>>& tasks, std::vector<std::vector<double>>& res, std::vector<std::vector<double>>& ratios, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const Options& options, double smallMinLimit, double detLim, double ctgLimit) const;
+		// the radial equation is solved on a non-uniform grid with this number of intervals, delta being the step of the exponent
+		static constexpr int numerovIntervals = 2000;
+		static constexpr double deltaGrid = 0.005;
+		// the number of energies the radial equation is solved for at once
+		static constexpr int numerovBatchSize = 4;
+
+		// the sizes of the tasks for the thread pool
+		static constexpr int energiesPerTask = 4 * numerovBatchSize;
+		static constexpr int kPointsPerTask = 4;
+
+		// the step of the energy grid, the adaptive scan uses a multiple of it
+		static constexpr double energyStep = 1E-3;
+
+		// the maximum step of the eigenvalue tracking, in grid steps
+		static constexpr int maxTrackingSteps = 32;
+
+		static constexpr int maxNewtonIterations = 8;
+
+		// the initial step of the phase shift tables, they are refined where needed
+		static constexpr double phaseShiftStep = 0.02;
+
+		// the energy grid is split in windows, the radial equation and the energy terms for each are computed by a task
+		// the k point tasks are started together with them and wait only for the windows they get to, not for the whole grid
+		class EnergyWindows
+		{
+		public:
+			EnergyWindows(ThreadPool& pool, int numIntervals, int windowSize)
+				: m_pool(pool), m_windowSize(windowSize), m_count((numIntervals + windowSize - 1) / windowSize), m_groups(std::make_unique<ThreadPool::TaskGroup[]>(m_count))
+			{
+			}
+
+			int GetCount() const { return m_count; }
+			int GetStart(int window) const { return window * m_windowSize; }
+			ThreadPool::TaskGroup& GetGroup(int window) { return m_groups[window]; }
+
+			// if the task for the window with the energy didn't start yet, it's run by the calling thread
+			// rethrows the exception of the task, if it failed
+			void WaitFor(int posE) const
+			{
+				m_pool.Wait(m_groups[posE / m_windowSize]);
+			}
+
+			// waits for all of them even if some failed, they use the local data of the computation, then rethrows the first exception
+			void WaitForAll() const
+			{
+				std::exception_ptr exception;
+				for (int window = 0; window < m_count; ++window)
+				{
+					try
+					{
+						m_pool.Wait(m_groups[window]);
+					}
+					catch (...)
+					{
+						if (!exception) exception = std::current_exception();
+					}
+				}
+
+				if (exception)
+					std::rethrow_exception(exception);
+			}
+
+		private:
+			ThreadPool& m_pool;
+			const int m_windowSize;
+			const int m_count;
+			std::unique_ptr<ThreadPool::TaskGroup[]> m_groups;
+		};
+
+		void ComputePhaseShifts(ThreadPool& pool, std::vector<PhaseShiftTable>& phaseShifts, const Potential& potential, const RadialGrid& grid, double minE, double maxE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const;
 
-		void GetResult(std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double olderDet, double detLim, double ctgLimit, double smallMinLimit, int lMax) const;
-		bool IsOverLimits(const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double detLim, double ctgLimit) const;
-		bool IsOverLimits2(const std::vector<std::vector<double>>& ratios, Lambda& lambda, int k, double E, double posE, double dE, double det, double oldDet, double olderDet, double detLim, double ctgLimit, double smallMinLimit, int lMax) const;
+		// for the energies in [startPos, nextPos)
+		void ComputeSchrodinger(const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, std::vector<std::vector<double>>& ratios, int startPos, int nextPos, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const;
+		void ComputeEnergyTerms(std::vector<EwaldEnergyTerms>& energyTerms, const std::vector<std::vector<double>>& ratios, int startPos, int nextPos, double minE, double dE, int lMax, const std::atomic_bool& terminate) const;
+		void ComputeBandstructure(ThreadPool& pool, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const;
+
+		void ComputeKPoints(int startPos, int nextPos, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, const Potential& potential, const RadialGrid& grid, const std::vector<PhaseShiftTable>& phaseShifts, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const;
+
+		// the scan on the grid with the energy loop outside, over the k points in [startPos, nextPos)
+		template<class DeterminantFunction> void ScanEnergyMajor(int startPos, int nextPos, Lambda& lambda, DeterminantFunction& determinant, const EnergyWindows& windows, std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, const ComputeOptions& options) const;
+
+		// returns the multiplicity of the root it found, 0 if none
+		int GetResult(std::vector<std::vector<double>>& res, const std::vector<std::vector<double>>& ratios, const LambdaBase& lambda, int k, double E, int posE, double dE, const LogDeterminant& det, const LogDeterminant& oldDet, const LogDeterminant& olderDet) const;
+
+		// counts the roots in the interval and refines them, used by the adaptive mode
+		template<class DeterminantFunction> void RefineInterval(std::vector<double>& res, DeterminantFunction& determinant, const LambdaBase& lambda, double Ea, double Eb, const LogDeterminant& detA, const LogDeterminant& detB, double tolerance) const;
+
+		// follows the eigenvalues of the KKR matrix in energy for the k point, on the energy grid, with a variable step
+		template<class DeterminantFunction> void TrackKPoint(std::vector<double>& res, Lambda& lambda, DeterminantFunction& determinant, const Vector3D<double>& k, const EnergyWindows& windows, const std::vector<std::vector<double>>& ratios, const std::vector<EwaldEnergyTerms>& energyTerms, int numIntervals, double minE, double dE, int lMax, const std::atomic_bool& terminate, double tolerance) const;
+		// refines the roots of the eigenvalues that cross zero in the interval
+		template<class DeterminantFunction> void RefineEigenvalues(std::vector<double>& res, DeterminantFunction& determinant, const LambdaBase& lambda, double Ea, double Eb, const Lambda::RealVector& valsA, const Lambda::RealVector& valsB, double tolerance) const;
+
+		// the neighbourhood of a pole that is skipped by the refinement
+		// kappa vanishes at E = 0, the terms with higher l blow up there and the sign changes close to it are artifacts, so more is skipped
+		static double PoleWidth(double pole, double tolerance) { return 0 == pole ? 0.5 * energyStep : 10. * tolerance; }
+
+		// Newton steps for a root interpolated on the grid, using the analytic energy derivative of the determinant
+		// returns E if they don't converge inside [Ea, Eb]
+		template<class DeterminantFunction> static double NewtonRefine(DeterminantFunction& determinant, double E, double Ea, double Eb, int multiplicity, double tolerance);
+
+		static bool IsDoubleRoot(const LogDeterminant& det, const LogDeterminant& oldDet, const LogDeterminant& olderDet);
 
-		static void SetPotential(Potential& potential, int numerovGridNodes, double Rp, double deltaGrid);
 		static double LinearInterpolation(double E, double dE, double det, double oldDet);
 		static double QuadraticInterpolation(double E, double dE, double det, double oldDet, double olderDet);
-		static bool IsChangeInSign(double posE, double det, double oldDet);
+		static bool IsChangeInSign(int posE, const LogDeterminant& det, const LogDeterminant& oldDet);
 		static bool IsBlowup(const std::vector<std::vector<double>>& ratios, double posE, int lMax, const std::atomic_bool& terminate);
+
+		// it's kept between computations, so they don't start the threads again
+		ThreadPool m_threadPool;
 	};
 
 }
@@ -10,7 +10,7 @@ namespace KKR
 {
 
 	BandStructureBasis::BandStructureBasis(double a, double rmax)
-		: m_a(a), m_Rmax(rmax)
+		: m_a(a), m_Rmax(rmax), m_ewald(a * a * a / 4.)
 	{
 		// if the passed value was zero or negative, make them touching spheres
 		if (m_Rmax <= 0)
@@ -19,11 +19,18 @@ namespace KKR
 		basisVectors.reserve(137);
 	}
 
-	bool BandStructureBasis::GenerateBasisVectorsMaxSize(int maxSize, int realSize)
+	bool BandStructureBasis::GenerateBasisVectorsMaxSize(double maxSize, double realSize)
 	{
 		basisVectors.clear();
 		realVectors.clear();
 
+		GenerateLatticeVectors(maxSize, realSize, basisVectors, realVectors);
+
+		return true;
+	}
+
+	void BandStructureBasis::GenerateLatticeVectors(double maxSize, double realSize, std::vector<Vector3D<double>>& reciprocalVectors, std::vector<Vector3D<double>>& realSpaceVectors)
+	{
 		// the Bravais lattice is a fcc lattice
 		// the reciprocal lattice is a bcc lattice 
 
@@ -49,24 +56,28 @@ namespace KKR
 		//const Vector3D<double> b3 = a1 % a2 / (a3 * (a1 % a2));
 		// the denominator is the volume, mentioned above
 
-		int maxSize2 = maxSize * maxSize;
+		double maxSize2 = maxSize * maxSize;
+
+		// the components of the vectors are at least as large as the integer coefficients, so this range covers the sphere
+		int range = static_cast<int>(ceil(maxSize));
 
-		for (int i = -maxSize; i <= maxSize; ++i)
-			for (int j = -maxSize; j <= maxSize; ++j)
-				for (int k = -maxSize; k <= maxSize; ++k)
+		for (int i = -range; i <= range; ++i)
+			for (int j = -range; j <= range; ++j)
+				for (int k = -range; k <= range; ++k)
 				{
 					const Vector3D vect(b1 * i + b2 * j + b3 * k); // reciprocal lattice vector
 
 					const double vectSquared = vect * vect;
 					if (vectSquared <= maxSize2 + 0.001) // if it's under the cutoff length, add it
-						basisVectors.push_back(vect);
+						reciprocalVectors.push_back(vect);
 				}
 
 		maxSize2 = realSize * realSize;
+		range = 2 * static_cast<int>(ceil(realSize));
 
-		for (int i = -2 * realSize; i <= 2 * realSize; ++i)
-			for (int j = -2 * realSize; j <= 2 * realSize; ++j)
-				for (int k = -2 * realSize; k <= 2 * realSize; ++k)
+		for (int i = -range; i <= range; ++i)
+			for (int j = -range; j <= range; ++j)
+				for (int k = -range; k <= range; ++k)
 				{
 					if (0 == i && 0 == j && 0 == k) continue; // not needed for D(2)
 
@@ -74,31 +85,44 @@ namespace KKR
 
 					const double vectSquared = vect * vect;
 					if (vectSquared <= maxSize2 + 0.001) // if it's under the cutoff length, add it
-						realVectors.push_back(vect);
+						realSpaceVectors.push_back(vect);
 				}
-
-
-		return true;
 	}
 
 
 
-	void BandStructureBasis::Initialize(std::vector<std::string> path, unsigned int nrPoints)
+	void BandStructureBasis::Initialize(std::vector<std::string> path, unsigned int nrPoints, unsigned int lMax)
 	{
+		m_lMax = lMax;
+
 		kpoints.clear();
 		kpoints.reserve(nrPoints);
 
 		m_path.swap(path);
 
-		GenerateBasisVectorsMaxSize(3, 1); // 27 vectors in reciprocal space, 18 in the real space
+		// the default cutoffs, 27 vectors in reciprocal space, 18 in the real space
+		SetEwaldParameters(EwaldParameters(GetCellVolume()));
+
+		const double recVectPre = 2. * M_PI / m_a;
+
+		kpoints = symmetryPoints.GeneratePoints(m_path, nrPoints, symmetryPointsPositions);
+
+		// adjust kpoints
+		for (auto& kpoint : kpoints)
+			kpoint *= recVectPre;
+	}
 
-		//GenerateBasisVectorsMaxSize(5, 2); // 137 vectors in reciprocal space, 140 in real space
-		//GenerateBasisVectorsMaxSize(8, 3); // 537 vectors in reciprocal space, 458 in real space
-		
-		// those are really overkill, they are here for tests:
+	void BandStructureBasis::SetEwaldParameters(const EwaldParameters& ewald)
+	{
+		m_ewald = ewald;
+
+		GenerateBasisVectorsMaxSize(ewald.reciprocalCutoff, ewald.realCutoff);
 
-		//GenerateBasisVectorsMaxSize(10, 4); // 1067 vectors in reciprocal space, 1060 in real space
-		//GenerateBasisVectorsMaxSize(15, 6); // 3527 vectors in reciprocal space, 3588 in real space
+		// other cutoffs, for tests:
+		// 5, 2: 137 vectors in reciprocal space, 140 in real space
+		// 8, 3: 537 vectors in reciprocal space, 458 in real space
+		// 10, 4: 1067 vectors in reciprocal space, 1060 in real space
+		// 15, 6: 3527 vectors in reciprocal space, 3588 in real space
 
 		// Have them sorted by length, eases up an optimization for D(2)
 		std::sort(realVectors.begin(), realVectors.end(),
@@ -114,11 +138,24 @@ namespace KKR
 		for (auto& rvec : realVectors)
 			rvec *= m_a;
 
-		kpoints = symmetryPoints.GeneratePoints(m_path, nrPoints, symmetryPointsPositions);
+		basisLattice.Set(basisVectors);
+		realLattice.Set(realVectors);
 
-		// adjust kpoints
-		for (auto& kpoint : kpoints)
-			kpoint *= recVectPre;
+		realHarmonics.Compute(realVectors, 2 * m_lMax);
+	}
+
+	EwaldParameters BandStructureBasis::TuneEwaldParameters(double minE, double maxE, double tolerance) const
+	{
+		// the candidates extend well beyond the cutoffs needed for the usual tolerances
+		std::vector<Vector3D<double>> reciprocalCandidates;
+		std::vector<Vector3D<double>> realCandidates;
+		GenerateLatticeVectors(12, 6, reciprocalCandidates, realCandidates);
+
+		double maxK = 0;
+		for (const auto& kpoint : kpoints)
+			maxK = std::max(maxK, kpoint.Length());
+
+		return EwaldParameters::Tune(reciprocalCandidates, realCandidates, m_a, GetCellVolume(), m_lMax, maxK, minE, maxE, tolerance);
 	}
 
 }
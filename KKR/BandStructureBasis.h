@@ -3,8 +3,11 @@
 #include <vector>
 
 #include "Vector3D.h"
+#include "LatticeVectors.h"
+#include "EwaldParameters.h"
 
 #include "SymmetryPoints.h"
+#include "SphericalHarmonics.h"
 
 namespace KKR
 {
@@ -22,24 +25,58 @@ public:
 	SymmetryPoints symmetryPoints;
 	std::vector<unsigned int> symmetryPointsPositions;
 
-	virtual void Initialize(std::vector<std::string> path, unsigned int nrPoints = 600);
+	// lMax = 2 is high enough for this toy program
+	virtual void Initialize(std::vector<std::string> path, unsigned int nrPoints = 600, unsigned int lMax = 2);
 
 	unsigned int GetPointsNumber() const { return static_cast<unsigned int>(kpoints.size()); }
 
 	const std::vector<std::string>& GetPath() const { return m_path; }
 
+	const std::vector<Vector3D<double>>& GetBasisVectors() const { return basisVectors; }
+	const std::vector<Vector3D<double>>& GetRealVectors() const { return realVectors; }
+	const std::vector<Vector3D<double>>& GetKPoints() const { return kpoints; }
+	const SphericalHarmonicsTable& GetRealHarmonics() const { return realHarmonics; }
+
+	// the same vectors as above, as structures of arrays, for the Ewald sums
+	const LatticeVectors& GetBasisLattice() const { return basisLattice; }
+	const LatticeVectors& GetRealLattice() const { return realLattice; }
+
+	// generates the lattice vectors for the cutoffs of the parameters, Initialize sets the defaults
+	void SetEwaldParameters(const EwaldParameters& ewald);
+	const EwaldParameters& GetEwaldParameters() const { return m_ewald; }
+
+	// the Ewald parameters for the structure constants within the tolerance, for the energies in [minE, maxE] and the k points from Initialize
+	EwaldParameters TuneEwaldParameters(double minE, double maxE, double tolerance) const;
+
+	double GetLatticeConstant() const { return m_a; }
+	double GetRmax() const { return m_Rmax; }
+	int GetLMax() const { return m_lMax; }
+	double GetCellVolume() const { return m_a * m_a * m_a / 4.; }
+
 protected:
 	std::vector<std::string> m_path;
 
 	std::vector<Vector3D<double>> basisVectors;
 	std::vector<Vector3D<double>> realVectors;
 
+	LatticeVectors basisLattice;
+	LatticeVectors realLattice;
+
+	// the spherical harmonics for the real space vectors, up to 2 * lMax, they don't change during the computation
+	SphericalHarmonicsTable realHarmonics;
+
 	std::vector<Vector3D<double>> kpoints;
 
 	double m_a;
 	double m_Rmax;
+	int m_lMax = 2;
+
+	EwaldParameters m_ewald;
+
+	bool GenerateBasisVectorsMaxSize(double maxSize, double realMaxSize);
 
-	bool GenerateBasisVectorsMaxSize(int maxSize, int realMaxSize);
+	// the cutoffs are in units of 2 pi / a for the reciprocal space and of a for the real space, the vectors are generated in the same units
+	static void GenerateLatticeVectors(double maxSize, double realMaxSize, std::vector<Vector3D<double>>& reciprocalVectors, std::vector<Vector3D<double>>& realSpaceVectors);
 };
 
 }
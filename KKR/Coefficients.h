@@ -5,7 +5,9 @@
 
 #include <array>
 #include <tuple>
+#include <utility>
 #include <unordered_map>
+#include <vector>
 
 namespace CG
 {
@@ -173,5 +175,77 @@ namespace CG
 		std::unordered_map<std::tuple<int, int, int, int, int>, double, TupleHash<int, int, int, int, int>> coefficients;
 	};
 
+
+	// the nonzero Gaunt coefficients needed for the KKR matrix, for all the (l, m), (l', m') pairs with l, l' <= max_l
+	// for each pair, the (L, C) values are stored contiguously, so they can be iterated directly, without hashing
+	// the pair (l, m) is indexed by l^2 + l + m
+	class GauntTable
+	{
+	public:
+		struct Entry
+		{
+			int L;
+			int LM; // the index of the (L, m - m') structure constant: L^2 + L + m - m'
+			double C;
+		};
+
+		GauntTable() = default;
+		GauntTable(const Coefficients& coeffs, int max_l)
+		{
+			Compute(coeffs, max_l);
+		}
+
+		// from already computed values, for example the compile time tables from GauntTables.h
+		GauntTable(std::vector<unsigned int>&& offs, std::vector<Entry>&& ents)
+			: offsets(std::move(offs)), entries(std::move(ents))
+		{
+			dim = 0;
+			while (static_cast<size_t>(dim) * dim + 1 < offsets.size()) ++dim;
+		}
+
+		void Compute(const Coefficients& coeffs, int max_l)
+		{
+			dim = (max_l + 1) * (max_l + 1);
+
+			offsets.assign(static_cast<size_t>(dim) * dim + 1, 0);
+			entries.clear();
+
+			int i = 0;
+			for (int l = 0; l <= max_l; ++l)
+				for (int m = -l; m <= l; ++m, ++i)
+				{
+					int j = 0;
+					for (int lp = 0; lp <= max_l; ++lp)
+						for (int mp = -lp; mp <= lp; ++mp, ++j)
+						{
+							offsets[static_cast<size_t>(i) * dim + j] = static_cast<unsigned int>(entries.size());
+
+							const int mmp = m - mp;
+							for (int L = abs(l - lp); L <= l + lp; L += 2)
+							{
+								if (abs(mmp) > L) continue;
+
+								const double C = coeffs.CalculateGaunt(l, lp, L, m, mp);
+								if (C != 0.)
+									entries.push_back({ L, L * L + L + mmp, C });
+							}
+						}
+				}
+
+			offsets.back() = static_cast<unsigned int>(entries.size());
+		}
+
+		const Entry* Begin(int i, int j) const { return entries.data() + offsets[static_cast<size_t>(i) * dim + j]; }
+		const Entry* End(int i, int j) const { return entries.data() + offsets[static_cast<size_t>(i) * dim + j + 1]; }
+
+		size_t GetSize() const { return entries.size(); }
+
+	private:
+		int dim = 0;
+
+		std::vector<unsigned int> offsets;
+		std::vector<Entry> entries;
+	};
+
 }
 
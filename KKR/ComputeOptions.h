@@ -0,0 +1,45 @@
+#pragma once
+
+// the part of the options the band structure computation needs
+// it doesn't depend on wxWidgets, so the solver can be used without the GUI, too
+class ComputeOptions
+{
+public:
+	int nrThreads = 4;
+
+	// the energy window that is scanned for bands
+	double minE = -0.05;
+	double maxE = 0.8;
+
+	// the adaptive mode scans the energies on a coarser grid, then refines the bracketed band energies with Brent's method
+	// instead of interpolating between the grid points, so it needs fewer KKR matrix computations and it's more precise
+	bool adaptive = false;
+	int coarseSteps = 8; // the coarse grid step, as a multiple of the default energy step of 1E-3 Hartree
+	double tolerance = 1E-7; // for the refined band energies, in Hartree
+
+	// instead of the determinant, the eigenvalues of the KKR matrix are followed in energy on the default grid
+	// the step is adapted to how fast they approach zero and each eigenvalue that crosses zero is refined with Brent's method
+	// it takes precedence over the adaptive mode
+	bool tracking = false;
+
+	// used only by the scan on the grid: the interpolated band energies are refined with Newton steps to the tolerance above,
+	// using the analytic energy derivative of the KKR matrix
+	bool newton = false;
+
+	// the logarithmic derivatives of the radial solutions are solved on an adaptive energy grid and interpolated,
+	// both for the energy grid and for the energies where the band search evaluates the KKR matrix off the grid
+	bool phaseShiftTable = false;
+
+	// the radial equation is solved for the ratios of consecutive values of the solution (the renormalized Numerov method)
+	// instead of the solution itself, so it cannot overflow
+	bool logDerivative = false;
+
+	// used only by the scan on the grid: the k points of a task are gone over for each energy, instead of each k point for all energies
+	// the terms of the structure constants that depend only on k are computed once for each of them and kept for the whole scan
+	bool energyMajor = false;
+
+	// if positive, the Ewald parameter and the cutoffs of the lattice sums for the structure constants are chosen
+	// for this estimated error of the structure constants over the energy window, otherwise the fixed defaults are used
+	double ewaldTolerance = 0;
+};
+
@@ -0,0 +1,197 @@
+#include "EwaldParameters.h"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "Lambda.h"
+
+namespace KKR {
+
+	namespace {
+
+		// the vectors are generated from integer combinations, the lengths of the ones in the same shell differ at most by rounding
+		constexpr double shellGap = 0.001;
+
+		// the series in energy converges as the one for exp(2 |E| / eta), above this it loses too much precision
+		constexpr double maxEnergyOverEta = 4;
+
+		// eta is tried in steps of sqrt(2) around the default value
+		constexpr int etaSteps = 4;
+
+		constexpr int reciprocalSamples = 5;
+
+		// the lengths squared, in the units the vectors were generated in, sorted
+		std::vector<double> GetSortedLengths2(const std::vector<Vector3D<double>>& vectors)
+		{
+			std::vector<double> lengths2;
+			lengths2.reserve(vectors.size());
+			for (const auto& vect : vectors)
+				lengths2.push_back(vect * vect);
+
+			std::sort(lengths2.begin(), lengths2.end());
+
+			return lengths2;
+		}
+
+		// |Y_LM| <= sqrt((2L + 1) / (4 pi))
+		double HarmonicBound(int L)
+		{
+			return sqrt((2. * L + 1.) / (4. * M_PI));
+		}
+
+		// bounds[L][n] are the bounds of the terms for the vector n, the vectors are sorted by length
+		// returns the smallest number of vectors to keep, ending with a whole shell and at least minSize, so that the sum of the bounds of the rest is below the tolerance for each L
+		// returns zero if that would need all the candidates
+		size_t FindCutoff(const std::vector<double>& lengths2, const std::vector<std::vector<double>>& bounds, double tolerance, size_t minSize)
+		{
+			const size_t size = lengths2.size();
+
+			std::vector<double> tails(bounds.size(), 0.);
+			size_t cutoff = 0;
+
+			// backwards, the tails hold the sums of the bounds for the vectors from n on
+			for (size_t n = size; n > std::max<size_t>(minSize, 1) - 1; --n)
+			{
+				if (std::any_of(tails.begin(), tails.end(), [tolerance](double tail) { return !(tail <= tolerance); }))
+					break;
+
+				if (n < size && lengths2[n] > lengths2[n - 1] + shellGap)
+					cutoff = n;
+
+				for (size_t L = 0; L < bounds.size(); ++L)
+					tails[L] += bounds[L][n - 1];
+			}
+
+			return cutoff;
+		}
+
+	}
+
+	EwaldParameters::EwaldParameters(double cellVolume)
+		: eta(4. * M_PI / std::pow(cellVolume, 2. / 3.))
+	{
+	}
+
+	EwaldParameters EwaldParameters::Tune(const std::vector<Vector3D<double>>& reciprocalVectors, const std::vector<Vector3D<double>>& realVectors, double latticeConstant, double cellVolume, int lMax, double maxK, double minE, double maxE, double tolerance)
+	{
+		const EwaldParameters defaults(cellVolume);
+
+		const int maxL = 2 * lMax;
+		const double maxAbsE = std::max(std::abs(minE), std::abs(maxE));
+
+		const std::vector<double> reciprocalLengths2 = GetSortedLengths2(reciprocalVectors);
+		const std::vector<double> realLengths2 = GetSortedLengths2(realVectors);
+
+		const double reciprocalUnit = 2. * M_PI / latticeConstant;
+
+		// the poles of the free Green function are at 2E = |Kn + k|^2, the vectors that can have them in the energy window are always kept
+		// with a margin, as the bounds below are too large close to them
+		const double poleMargin = 0.5;
+		size_t minReciprocal = 0;
+		while (minReciprocal < reciprocalLengths2.size() && std::max(0., sqrt(reciprocalLengths2[minReciprocal]) * reciprocalUnit - maxK) <= sqrt(std::max(0., 2. * maxE + poleMargin)))
+			++minReciprocal;
+
+		EwaldParameters best = defaults;
+		size_t bestCost = std::numeric_limits<size_t>::max();
+
+		for (int step = -etaSteps; step <= etaSteps; ++step)
+		{
+			const double eta = defaults.eta * std::pow(2., 0.5 * step);
+			const double energyOverEta = 2. * maxAbsE / eta;
+			if (energyOverEta > maxEnergyOverEta) continue;
+
+			// the first term, for kappa^L D_LM: 4 pi / V * exp((2E - q^2) / eta) q^L |Y_LM| / |q^2 - 2E|, with q = |Kn + k|
+			// it's largest for the highest energy, q is sampled between |Kn| - |k| and |Kn| + |k|
+			std::vector<std::vector<double>> reciprocalBounds(maxL + 1ULL, std::vector<double>(reciprocalLengths2.size()));
+			for (size_t n = 0; n < reciprocalLengths2.size(); ++n)
+			{
+				const double length = sqrt(reciprocalLengths2[n]) * reciprocalUnit;
+
+				for (int L = 0; L <= maxL; ++L)
+				{
+					double bound = 0;
+					for (int sample = 0; sample < reciprocalSamples; ++sample)
+					{
+						const double q = std::max(0., length - maxK + 2. * maxK * sample / (reciprocalSamples - 1.));
+						const double denominator = q * q - 2. * maxE;
+						if (denominator <= 0)
+						{
+							bound = std::numeric_limits<double>::infinity();
+							break;
+						}
+
+						bound = std::max(bound, std::exp((2. * maxE - q * q) / eta) * std::pow(q, L) / denominator);
+					}
+
+					reciprocalBounds[L][n] = 4. * M_PI / cellVolume * HarmonicBound(L) * bound;
+				}
+			}
+
+			const size_t nrReciprocal = FindCutoff(reciprocalLengths2, reciprocalBounds, 0.5 * tolerance, minReciprocal);
+			if (0 == nrReciprocal) continue;
+
+			// the number of terms for the series in energy, the last one should be negligible
+			int seriesTerms = defaults.seriesTerms;
+			double lastTerm = 1;
+			for (int s = 1; s <= seriesTerms; ++s)
+				lastTerm *= energyOverEta / s;
+			while (lastTerm > 1E-16)
+				lastTerm *= energyOverEta / ++seriesTerms;
+
+			// the second term, for kappa^L D_LM: 2^(L+1) / sqrt(pi) |Y_LM| |integral|
+			// all the terms of the series are positive for positive energy, so the integral for the largest |E| bounds the others
+			// the integral is the same for the whole shell
+			std::vector<double> shellLengths2;
+			std::vector<size_t> shells(realLengths2.size());
+			for (size_t n = 0; n < realLengths2.size(); ++n)
+			{
+				if (0 == n || realLengths2[n] > realLengths2[n - 1] + shellGap)
+					shellLengths2.push_back(realLengths2[n] * latticeConstant * latticeConstant);
+
+				shells[n] = shellLengths2.size() - 1;
+			}
+
+			const std::vector<double> gammas = LambdaBase::ComputeShellGammas(shellLengths2, eta, maxL, seriesTerms);
+			const size_t gammasPerShell = maxL + static_cast<size_t>(seriesTerms);
+
+			std::vector<std::vector<double>> realBounds(maxL + 1ULL, std::vector<double>(realLengths2.size()));
+			for (int L = 0; L <= maxL; ++L)
+			{
+				const double prefactor = std::pow(2., L + 1.) / sqrt(M_PI) * HarmonicBound(L);
+
+				std::vector<double> integrals(shellLengths2.size());
+				for (size_t shell = 0; shell < shellLengths2.size(); ++shell)
+					integrals[shell] = LambdaBase::RealSpaceIntegral(L, shellLengths2[shell], maxAbsE, seriesTerms, gammas.data() + shell * gammasPerShell);
+
+				for (size_t n = 0; n < realLengths2.size(); ++n)
+					realBounds[L][n] = prefactor * std::abs(integrals[shells[n]]);
+			}
+
+			const size_t nrReal = FindCutoff(realLengths2, realBounds, 0.5 * tolerance, 1);
+			if (0 == nrReal) continue;
+
+			// the reciprocal sum is computed for each energy and k point, for the real space one only the sum over shells is
+			size_t nrRealShells = 1;
+			for (size_t n = 1; n < nrReal; ++n)
+				if (realLengths2[n] > realLengths2[n - 1] + shellGap)
+					++nrRealShells;
+
+			const size_t cost = nrReciprocal + nrRealShells;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+
+				best.eta = eta;
+				best.reciprocalCutoff = sqrt(reciprocalLengths2[nrReciprocal - 1]);
+				best.realCutoff = sqrt(realLengths2[nrReal - 1]);
+				best.seriesTerms = seriesTerms;
+			}
+		}
+
+		return best;
+	}
+
+}
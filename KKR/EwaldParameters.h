@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include "Vector3D.h"
+
+namespace KKR {
+
+	// the parameters of the Ewald summation for the structure constants
+	// eta splits the sum between the reciprocal and the real space, the cutoffs limit the lattice vectors of each
+	class EwaldParameters
+	{
+	public:
+		// the defaults: eta = 4 pi / V^(2/3), the 27 reciprocal and 18 real space vectors of the fcc lattice
+		EwaldParameters(double cellVolume = 1.);
+
+		// picks eta and the smallest cutoffs for which the estimated truncation error of D_LM (times kappa^L) is below the tolerance
+		// for all L <= 2 lMax, the energies in [minE, maxE] and the k points with |k| <= maxK
+		// the candidate vectors (not scaled, sorted by length) must extend beyond the needed cutoffs, eta values that would need more are skipped
+		// from the ones that remain, the one with the fewest terms to sum is chosen
+		// if none remains, the defaults are returned
+		static EwaldParameters Tune(const std::vector<Vector3D<double>>& reciprocalVectors, const std::vector<Vector3D<double>>& realVectors, double latticeConstant, double cellVolume, int lMax, double maxK, double minE, double maxE, double tolerance);
+
+		double eta;
+
+		// the reciprocal cutoff is in units of 2 pi / a, the real space one in units of a
+		double reciprocalCutoff = 3;
+		double realCutoff = 1;
+
+		// the number of terms of the series in energy, for the real space integrals and the third term
+		int seriesTerms = 16;
+	};
+
+	inline bool operator==(const EwaldParameters& p1, const EwaldParameters& p2) { return p1.eta == p2.eta && p1.reciprocalCutoff == p2.reciprocalCutoff && p1.realCutoff == p2.realCutoff && p1.seriesTerms == p2.seriesTerms; }
+	inline bool operator!=(const EwaldParameters& p1, const EwaldParameters& p2) { return !(p1 == p2); }
+
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <array>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include "Coefficients.h"
+
+namespace CG
+{
+
+	// Gaunt coefficients computed at compile time, for the common lMax values
+	// the formulae are the same as in Coefficients, but everything is constexpr
+	// so the tables are generated by the compiler and the program does no coefficient work at startup
+
+	namespace Constexpr
+	{
+		// Newton iteration starting from above, it decreases monotonically until it converges
+		// the argument is scaled by powers of 4 to [1, 4) first, so only a few iterations are needed
+		constexpr double Sqrt(double x)
+		{
+			if (x <= 0) return 0;
+
+			double scale = 1;
+			while (x >= 0x1p16)
+			{
+				x *= 0x1p-16;
+				scale *= 0x1p8;
+			}
+			while (x < 0x1p-16)
+			{
+				x *= 0x1p16;
+				scale *= 0x1p-8;
+			}
+			while (x >= 4)
+			{
+				x *= 0.25;
+				scale *= 2;
+			}
+			while (x < 1)
+			{
+				x *= 4;
+				scale *= 0.5;
+			}
+
+			double cur = 2;
+			for (;;)
+			{
+				const double next = 0.5 * (cur + x / cur);
+				if (next >= cur) break;
+				cur = next;
+			}
+
+			return cur * scale;
+		}
+
+		// the arguments of the factorials in ClebschGordan are at most j1 + j2 + j3 + 1, that is 4 lMax + 1 for the Gaunt coefficients
+		constexpr int maxFactorial = 32;
+
+		constexpr std::array<double, maxFactorial + 1> MakeFactorials()
+		{
+			std::array<double, maxFactorial + 1> values{};
+
+			double val = 1;
+			values[0] = 1;
+			for (int i = 1; i <= maxFactorial; ++i)
+			{
+				if (i > 1) val *= i;
+				values[i] = val;
+			}
+
+			return values;
+		}
+
+		// computed once, looking them up is much cheaper for the compiler than computing them for each coefficient
+		inline constexpr std::array<double, maxFactorial + 1> factorials = MakeFactorials();
+
+		constexpr double Factorial(int n)
+		{
+			return factorials[n];
+		}
+
+		constexpr double Sign(int n)
+		{
+			return (n % 2) ? -1. : 1.;
+		}
+
+		constexpr int Max(int a, int b) { return a > b ? a : b; }
+		constexpr int Min(int a, int b) { return a < b ? a : b; }
+		constexpr int Abs(int a) { return a < 0 ? -a : a; }
+
+		// only integer values are needed here
+		constexpr double ClebschGordan(int j1, int j2, int j3, int m1, int m2, int m3)
+		{
+			if (m1 < -j1 || m1 > j1 || m2 < -j2 || m2 > j2 || m3 < -j3 || m3 > j3) return 0;
+			else if (j3 < Abs(j1 - j2) || j3 > j1 + j2) return 0;
+			else if (m3 != m1 + m2) return 0;
+
+			double val = 0;
+
+			const int limMin = Max(Max(j2 - j3 - m1, j1 - j3 + m2), 0);
+			const int limMax = Min(j2 + m2, Min(j1 - m1, j1 + j2 - j3));
+			for (int k = limMin; k <= limMax; ++k)
+				val += Sign(k) / (Factorial(k) * Factorial(j1 + j2 - j3 - k) * Factorial(j1 - m1 - k) *
+					Factorial(j2 + m2 - k) * Factorial(j3 - j2 + m1 + k) * Factorial(j3 - j1 - m2 + k));
+
+			if (0 == val) return 0;
+
+			return val * Sqrt((2. * j3 + 1.) * Factorial(j3 + j1 - j2) * Factorial(j3 - j1 + j2) *
+				Factorial(j1 + j2 - j3) / Factorial(j1 + j2 + j3 + 1)) *
+				Sqrt(Factorial(j1 + m1) * Factorial(j1 - m1) *
+					Factorial(j2 + m2) * Factorial(j2 - m2) *
+					Factorial(j3 + m3) * Factorial(j3 - m3));
+		}
+
+		constexpr double Wigner3j(int j1, int j2, int j3, int m1, int m2, int m3)
+		{
+			if (m1 < -j1 || m1 > j1 || m2 < -j2 || m2 > j2 || m3 < -j3 || m3 > j3) return 0;
+			else if (j3 < Abs(j1 - j2) || j3 > j1 + j2) return 0;
+			else if (m1 + m2 + m3 != 0) return 0;
+
+			if (0 == m1 && 0 == m2 && 0 == m3 && (j1 + j2 + j3) % 2) return 0;
+
+			return Sign(Abs(j2 - j1 - m3)) / Sqrt(2. * j3 + 1.) * ClebschGordan(j1, j2, j3, m1, m2, -m3);
+		}
+
+		constexpr double Gaunt(int j1, int j2, int j3, int m1, int m2)
+		{
+			if ((j1 + j2 + j3) % 2) return 0;
+
+			return Sign(Abs(m1)) * Sqrt((2. * j1 + 1.) * (2. * j2 + 1.) * (2. * j3 + 1.) / (4. * M_PI)) *
+				Wigner3j(j1, j2, j3, 0, 0, 0) * Wigner3j(j1, j2, j3, m1, -m2, m2 - m1);
+		}
+
+		// calls func(j, L, m - m', C) for each nonzero coefficient for (l, m), in the GauntTable order
+		template<class Func> constexpr void ForEachGauntInRow(int max_l, int l, int m, Func& func)
+		{
+			int j = 0;
+			for (int lp = 0; lp <= max_l; ++lp)
+				for (int mp = -lp; mp <= lp; ++mp, ++j)
+				{
+					const int mmp = m - mp;
+					for (int L = Abs(l - lp); L <= l + lp; L += 2)
+					{
+						if (Abs(mmp) > L) continue;
+
+						const double C = Gaunt(l, lp, L, m, mp);
+						if (C != 0.)
+							func(j, L, mmp, C);
+					}
+				}
+		}
+
+		// the coefficients for one (l, m), the ones for (l', m') with the index j are between offsets[j] and offsets[j + 1]
+		template<size_t DIM, size_t CAPACITY> struct GauntRow
+		{
+			std::array<unsigned int, DIM + 1> offsets{};
+			std::array<GauntTable::Entry, CAPACITY> entries{};
+			size_t count = 0;
+
+			// the pairs come in order, so for a pair the end offset is the position after its last entry
+			constexpr void operator()(int j, int L, int mmp, double C)
+			{
+				entries[count] = GauntTable::Entry{ L, L * L + L + mmp, C };
+				++count;
+				offsets[static_cast<size_t>(j) + 1] = static_cast<unsigned int>(count);
+			}
+		};
+	}
+
+
+	// the compilers limit the number of operations of a constant evaluation, the whole table for lMax = 4 would need several times more than the usual limits
+	// so each row of the table, for one (l, m), is computed in a separate evaluation and they are not put together afterwards, that would need too many as well
+	template<int LMAX> class FixedGauntRows
+	{
+	public:
+		static_assert(4 * LMAX + 1 <= Constexpr::maxFactorial, "the factorials table is too small");
+
+		static constexpr int dim = (LMAX + 1) * (LMAX + 1);
+
+		// a pair has at most LMAX + 1 values of L
+		static constexpr size_t capacity = dim * (LMAX + 1ULL);
+
+		using Row = Constexpr::GauntRow<dim, capacity>;
+
+		static constexpr Row Make(int i)
+		{
+			int l = 0;
+			while ((l + 1) * (l + 1) <= i) ++l;
+			const int m = i - l * l - l;
+
+			Row row;
+			Constexpr::ForEachGauntInRow(LMAX, l, m, row);
+
+			// the pairs without coefficients were not touched, they end where the previous pair ends
+			for (size_t j = 1; j < row.offsets.size(); ++j)
+				if (row.offsets[j] < row.offsets[j - 1])
+					row.offsets[j] = row.offsets[j - 1];
+
+			return row;
+		}
+	};
+
+	template<int LMAX, size_t I> inline constexpr typename FixedGauntRows<LMAX>::Row fixedGauntRow = FixedGauntRows<LMAX>::Make(static_cast<int>(I));
+
+
+	// the compile time table, with the same layout as GauntTable, but the rows are separate
+	template<int LMAX> class FixedGauntTable
+	{
+	public:
+		static constexpr int dim = FixedGauntRows<LMAX>::dim;
+
+		using Row = typename FixedGauntRows<LMAX>::Row;
+
+		// the same coefficients in a GauntTable
+		static GauntTable MakeTable()
+		{
+			std::vector<unsigned int> offsets(1, 0);
+			std::vector<GauntTable::Entry> entries;
+
+			for (const Row* row : rows)
+			{
+				const unsigned int start = static_cast<unsigned int>(entries.size());
+				for (int j = 0; j < dim; ++j)
+					offsets.push_back(start + row->offsets[j + 1LL]);
+
+				entries.insert(entries.end(), row->entries.begin(), row->entries.begin() + row->count);
+			}
+
+			return GauntTable(std::move(offsets), std::move(entries));
+		}
+
+	private:
+		template<size_t... I> static constexpr std::array<const Row*, dim> MakeRows(std::index_sequence<I...>)
+		{
+			return { &fixedGauntRow<LMAX, I>... };
+		}
+
+		static constexpr std::array<const Row*, dim> rows = MakeRows(std::make_index_sequence<dim>());
+	};
+
+
+	// uses the compile time tables for the common lMax values, computes the coefficients otherwise
+	inline GauntTable MakeGauntTable(int max_l)
+	{
+		switch (max_l)
+		{
+		case 2:
+			return FixedGauntTable<2>::MakeTable();
+		case 3:
+			return FixedGauntTable<3>::MakeTable();
+		case 4:
+			return FixedGauntTable<4>::MakeTable();
+		}
+
+		return GauntTable(Coefficients(), max_l);
+	}
+
+}
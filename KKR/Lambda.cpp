@@ -3,59 +3,391 @@
 #include <math.h>
 
 #include <cassert>
+#include <algorithm>
 
 #include "Lambda.h"
 
 namespace KKR
 {
-	bool Lambda::IsCloseToPole(double E, const Vector3D<double>& k, double limit, const std::vector<double>& ratios, double limit2) const
+	bool LambdaBase::IsCloseToPole(double E, const Vector3D<double>& k, double limit) const
 	{
 		// singular points of the free Green function:
-		for (const auto& Kn : m_basisVectors)
+		for (size_t n = 0; n < m_basisVectors.GetSize(); ++n)
 		{
-			const Vector3D kn(Kn + k);
-			const double kn2 = kn * kn;
+			const double knx = m_basisVectors.x[n] + k.X;
+			const double kny = m_basisVectors.y[n] + k.Y;
+			const double knz = m_basisVectors.z[n] + k.Z;
+			const double kn2 = knx * knx + kny * kny + knz * knz;
 			const double Eminuskn2 = 2. * E - kn2;
 
 			if (abs(Eminuskn2) < limit)
 				return true;
 		}
 
-		// also for cotangent of the phase shift:
+		return false;
+	}
+
+	bool LambdaBase::HasPhaseShiftPole(double Ea, const std::vector<double>& ratiosA, double Eb, const std::vector<double>& ratiosB) const
+	{
+		// the sign of kappa j_l' - j_l logDeriv is not defined across E = 0, the Bessel functions switch from real to imaginary there
+		if (Ea < 0 && Eb >= 0) return false;
+
+		const int lMax = static_cast<int>(std::min(ratiosA.size(), ratiosB.size())) - 1;
+		for (int l = 0; l <= lMax; ++l)
+			if ((PhaseShiftDenominator(l, Ea, ratiosA[l]) < 0) != (PhaseShiftDenominator(l, Eb, ratiosB[l]) < 0))
+				return true;
+
+		return false;
+	}
 
+	double LambdaBase::PhaseShiftDenominator(int l, double E, double ratio) const
+	{
 		const std::complex<double> kappa((E >= 0 ? sqrt(2. * E) : 0), (E < 0 ? sqrt(-2. * E) : 0));
 		const std::complex<double> kappaR = kappa * m_R;
+		const double logDeriv = ratio - m_oneOverR;
 
-		const int lMax = static_cast<int>(ratios.size());
-		for (int l = 0; l <= lMax; ++l)
-		{
-			const double logDeriv = ratios[l] - m_oneOverR;
+		const std::complex<double> denominator = SpecialFunctions::Bessel::jderiv(l, kappaR) * kappa - SpecialFunctions::Bessel::j(l, kappaR) * logDeriv;
 
-			const std::complex<double> check = SpecialFunctions::Bessel::jderiv(l, kappaR) * kappa - SpecialFunctions::Bessel::j(l, kappaR) * logDeriv;
+		// it's i^l times a real value, so only one of the parts is nonzero, with the same sign convention for all energies on the same side of zero
+		return denominator.real() + denominator.imag();
+	}
+
+
+	LambdaBase::LambdaBase(const LatticeVectors& basisVectors, const LatticeVectors& realVectors, const SphericalHarmonicsTable& realHarmonics, double R, double cellVolume, const EwaldParameters& ewald, unsigned int lmax)
+		: m_basisVectors(basisVectors), m_realVectors(realVectors), m_R(R), m_oneOverR(1. / R), m_cellVolume(cellVolume), m_lMax(lmax),
+		m_eta(ewald.eta), m_seriesTerms(ewald.seriesTerms),
+		m_realHarmonics(realHarmonics)
+	{
+		assert(m_realHarmonics.GetMaxL() >= 2 * m_lMax && m_realHarmonics.GetSize() == m_realVectors.GetSize());
+
+		m_shellGammas = ComputeShellGammas(m_realVectors.shellLengths2, m_eta, 2 * m_lMax, m_seriesTerms);
+
+		Dvalues.resize((2ULL * m_lMax + 1) * (2ULL * m_lMax + 1));
+		DDerivatives.resize(Dvalues.size());
+	}
 
-			if (abs(check) < limit2)
+	bool LambdaBase::HasPole(double Ea, double Eb) const
+	{
+		if (Ea <= 0 && Eb >= 0) return true;
+
+		const double twoEa = 2. * Ea;
+		const double twoEb = 2. * Eb;
+
+		for (const double kn2 : m_kTerms.kn2)
+			if (kn2 >= twoEa && kn2 <= twoEb)
 				return true;
-		}
 
 		return false;
 	}
 
+	std::vector<double> LambdaBase::GetPoles(double Ea, double Eb) const
+	{
+		std::vector<double> poles;
+		if (Ea <= 0 && Eb >= 0) poles.push_back(0);
+
+		for (const double kn2 : m_kTerms.kn2)
+		{
+			const double E = 0.5 * kn2;
+			if (E >= Ea && E <= Eb)
+				poles.push_back(E);
+		}
+
+		std::sort(poles.begin(), poles.end());
+		poles.erase(std::unique(poles.begin(), poles.end()), poles.end());
+
+		return poles;
+	}
+
+	EwaldEnergyTerms LambdaBase::ComputeEnergyTerms(double E, bool derivatives) const
+	{
+		EwaldEnergyTerms terms;
+		ComputeEnergyTerms(E, terms, derivatives);
+
+		return terms;
+	}
 
-	std::complex<double> Lambda::D(double E, const Vector3D<double>& k, int L, int M, const CG::Coefficients& coeffs) const
+	void LambdaBase::ComputeEnergyTerms(double E, EwaldEnergyTerms& terms, bool derivatives) const
 	{
-		//const double eta = 1.56;
-		const double eta = 4. * M_PI / std::pow(m_cellVolume, 2. / 3.);
-		const double inveta = 1. / eta;
-		const double invCellVolume = 1. / m_cellVolume;
+		terms.hasDerivatives = derivatives;
 
-		const std::complex<double> kappa((E >= 0 ? sqrt(2. * E) : 0), (E < 0 ? sqrt(-2. * E) : 0));
+		const int maxL = 2 * m_lMax;
 
-		const std::complex<double> kappamL = std::pow(kappa, -L);
+		const std::complex<double> kappa((E >= 0 ? sqrt(2. * E) : 0), (E < 0 ? sqrt(-2. * E) : 0));
 		const std::complex<double> I(0, 1);
-		const std::complex<double> iL = std::pow(I, L);
+		const double EpEta = 2. * E / m_eta;
+		const double expEpEta = std::exp(EpEta);
+
+		terms.D1Prefactor.resize(maxL + 1ULL);
+		terms.D2Prefactor.resize(maxL + 1ULL);
+		for (int L = 0; L <= maxL; ++L)
+		{
+			const std::complex<double> kappamL = std::pow(kappa, -L);
+
+			terms.D1Prefactor[L] = 4. * M_PI / m_cellVolume * kappamL * expEpEta;
+			terms.D2Prefactor[L] = 1. / sqrt(M_PI) * std::pow(-2, L + 1) * std::pow(I, L) * kappamL;
+		}
+
+		if (derivatives)
+		{
+			// d kappa^-L / dE = -L kappa^-L / (2E)
+			terms.D1PrefactorDerivative.resize(maxL + 1ULL);
+			terms.D2PrefactorDerivative.resize(maxL + 1ULL);
+			for (int L = 0; L <= maxL; ++L)
+			{
+				const double kappaTerm = L ? -0.5 * L / E : 0.;
+
+				terms.D1PrefactorDerivative[L] = terms.D1Prefactor[L] * (kappaTerm + 2. / m_eta);
+				terms.D2PrefactorDerivative[L] = terms.D2Prefactor[L] * kappaTerm;
+			}
+		}
+
+		// the integral from the second term depends only on the length of the real space vector, so compute it once for each shell
+		terms.nrShells = m_realVectors.GetNrShells();
+		terms.integrals.resize((maxL + 1ULL) * terms.nrShells);
+		if (derivatives) terms.integralDerivatives.resize(terms.integrals.size());
+		for (size_t shell = 0; shell < terms.nrShells; ++shell)
+		{
+			const double rs2 = m_realVectors.shellLengths2[shell];
+			const double* gammas = m_shellGammas.data() + shell * (maxL + m_seriesTerms);
+
+			for (int L = 0; L <= maxL; ++L)
+			{
+				if (derivatives)
+					terms.integrals[L * terms.nrShells + shell] = RealSpaceIntegral(L, rs2, E, m_seriesTerms, gammas, &terms.integralDerivatives[L * terms.nrShells + shell]);
+				else
+					terms.integrals[L * terms.nrShells + shell] = RealSpaceIntegral(L, rs2, E, m_seriesTerms, gammas);
+			}
+		}
+
+		// **************** third term ******************************************************************************************
+		// nonzero only for L = 0
+
+		terms.D3 = 0;
+		for (int s = 0; s < m_seriesTerms; ++s)
+		{
+			const double term = std::pow(EpEta, s) / ((2. * s - 1.) * CG::Coefficients::Factorial(s));
+			terms.D3 += term;
+			if (abs(term) < 1E-13) break;
+		}
+
+		terms.D3 *= -0.5 * sqrt(m_eta) * M_1_PI;
+
+		if (derivatives)
+		{
+			terms.D3Derivative = 0;
+			for (int s = 1; s < m_seriesTerms; ++s)
+			{
+				const double term = std::pow(EpEta, s - 1) / ((2. * s - 1.) * CG::Coefficients::Factorial(s - 1));
+				terms.D3Derivative += term;
+				if (abs(term) < 1E-13) break;
+			}
+
+			terms.D3Derivative *= -sqrt(m_eta) * M_1_PI / m_eta;
+		}
+
+		// the free solutions, for the diagonal of the matrix
+		const std::complex<double> kappaR = kappa * m_R;
+
+		terms.kappa = kappa;
+		terms.besselJ.resize(m_lMax + 1ULL);
+		terms.besselN.resize(m_lMax + 1ULL);
+		terms.besselJDerivative.resize(m_lMax + 1ULL);
+		terms.besselNDerivative.resize(m_lMax + 1ULL);
+		for (int l = 0; l <= m_lMax; ++l)
+		{
+			terms.besselJ[l] = SpecialFunctions::Bessel::j(l, kappaR);
+			terms.besselN[l] = SpecialFunctions::Bessel::n(l, kappaR);
+			terms.besselJDerivative[l] = SpecialFunctions::Bessel::jderiv(l, kappaR);
+			terms.besselNDerivative[l] = SpecialFunctions::Bessel::nderiv(l, kappaR);
+		}
+	}
+
+	std::vector<double> LambdaBase::ComputeShellGammas(const std::vector<double>& shellLengths2, double eta, int maxL, int seriesTerms)
+	{
+		// the series in energy needs a from 1/2 - (seriesTerms - 1) for m = seriesTerms - 1, up to 1/2 + maxL
+		const int count = maxL + seriesTerms;
+		const double aMin = 0.5 - (seriesTerms - 1.);
+
+		std::vector<double> gammas(shellLengths2.size() * count);
+		for (size_t shell = 0; shell < shellLengths2.size(); ++shell)
+			SpecialFunctions::GammaTable(aMin, count, shellLengths2[shell] * eta / 4., gammas.data() + shell * count);
+
+		return gammas;
+	}
+
+	double LambdaBase::RealSpaceIntegral(int L, double rs2, double E, int seriesTerms, const double* gammas, double* derivative)
+	{
+		const double rs = sqrt(rs2);
+		const double Ers2over2 = E * rs2 / 2.;
+
+		// Gamma(1/2 + L - m, rs^2 eta / 4)
+		gammas += L + seriesTerms - 1;
+
+		double integral = 0;
+		double integralDerivative = 0;
+		double power = 1; // (E rs^2 / 2)^m / m!
+		double previousPower = 0;
+		for (int m = 0; m < seriesTerms; ++m)
+		{
+			const double gamma = gammas[-m];
+			const double term = power * gamma;
+			integral += term;
+
+			// d/dE of (E rs^2 / 2)^m / m!
+			if (derivative && m)
+				integralDerivative += previousPower * 0.5 * rs2 * gamma;
+
+			if (abs(term) < 1E-13) break;
+
+			previousPower = power;
+			power *= Ers2over2 / (m + 1.);
+		}
+
+		// the rs^L factor from the sum is included here, too
+		const double rsFactor = 0.5 / std::pow(rs, L + 1.);
+		if (derivative) *derivative = integralDerivative * rsFactor;
+
+		return integral * rsFactor;
+	}
+
+	EwaldKPointTerms LambdaBase::ComputeKPointTerms(const Vector3D<double>& k) const
+	{
+		EwaldKPointTerms terms;
+		terms.k = k;
+
+		const int maxL = 2 * m_lMax;
+		const size_t nrAllLM = (maxL + 1ULL) * (maxL + 1ULL);
+		terms.nrLM = (maxL + 1ULL) * (maxL + 2ULL) / 2;
+		const size_t stride = 2 * terms.nrLM;
+
+		// the vectors Kn + k and the factors that don't depend on L, in separate loops over the arrays, so they are vectorized
+		const size_t nrVectors = m_basisVectors.GetSize();
+		terms.nrBasisVectors = nrVectors;
+
+		std::vector<double> knx(nrVectors);
+		std::vector<double> kny(nrVectors);
+		std::vector<double> knz(nrVectors);
+		terms.kn2.resize(nrVectors);
+		for (size_t n = 0; n < nrVectors; ++n)
+		{
+			knx[n] = m_basisVectors.x[n] + k.X;
+			kny[n] = m_basisVectors.y[n] + k.Y;
+			knz[n] = m_basisVectors.z[n] + k.Z;
+			terms.kn2[n] = knx[n] * knx[n] + kny[n] * kny[n] + knz[n] * knz[n];
+		}
+
+		const double inveta = 1. / m_eta;
+
+		std::vector<double> knLength(nrVectors);
+		std::vector<double> knGauss(nrVectors);
+		for (size_t n = 0; n < nrVectors; ++n)
+		{
+			knLength[n] = sqrt(terms.kn2[n]);
+			knGauss[n] = exp(-terms.kn2[n] * inveta);
+		}
+
+		// all L and M for each vector, the powers of the length by recurrence
+		const SpecialFunctions::SphericalHarmonics harmonics(maxL);
+		std::vector<std::complex<double>> Y(nrAllLM);
+
+		terms.reciprocalTerms.resize(stride * nrVectors);
+		for (size_t n = 0; n < nrVectors; ++n)
+		{
+			harmonics.Compute(knx[n], kny[n], knz[n], Y.data());
+
+			double* values = terms.reciprocalTerms.data() + n * stride;
+			double factor = knGauss[n];
+			for (int L = 0; L <= maxL; ++L)
+			{
+				for (int M = 0; M <= L; ++M)
+				{
+					const std::complex<double> value = factor * Y[SphericalHarmonicsTable::Index(L, M)];
+					const int LM = EwaldKPointTerms::CompactIndex(L, M);
+
+					values[2 * LM] = value.real();
+					values[2 * LM + 1] = value.imag();
+				}
+
+				factor *= knLength[n];
+			}
+		}
+
+		// the phases for the real space vectors
+		const size_t nrRealVectors = m_realVectors.GetSize();
+
+		std::vector<double> cosPhase(nrRealVectors);
+		std::vector<double> sinPhase(nrRealVectors);
+		for (size_t n = 0; n < nrRealVectors; ++n)
+		{
+			const double phase = k.X * m_realVectors.x[n] + k.Y * m_realVectors.y[n] + k.Z * m_realVectors.z[n];
+			cosPhase[n] = cos(phase);
+			sinPhase[n] = sin(phase);
+		}
+
+		// the vectors in a shell share the radial integral, so only the sums over the shells are needed
+		terms.nrShells = m_realVectors.GetNrShells();
+		terms.shellTerms.assign(terms.nrLM * terms.nrShells, std::complex<double>(0, 0));
+		for (size_t n = 0; n < nrRealVectors; ++n)
+		{
+			const std::complex<double> phase(cosPhase[n], sinPhase[n]);
+			const std::complex<double>* realY = m_realHarmonics.GetValues(n);
+			const size_t shell = m_realVectors.shell[n];
+
+			for (int L = 0; L <= maxL; ++L)
+				for (int M = 0; M <= L; ++M)
+					terms.shellTerms[EwaldKPointTerms::CompactIndex(L, M) * terms.nrShells + shell] += phase * realY[SphericalHarmonicsTable::Index(L, M)];
+		}
+
+		return terms;
+	}
+
+	void LambdaBase::SetKPoint(const Vector3D<double>& k)
+	{
+		m_kTerms = ComputeKPointTerms(k);
+		m_hasKPoint = true;
+	}
+
+	void LambdaBase::ComputeReciprocalSums(double E, const EwaldKPointTerms& kTerms, double* inverseDenominators, double* sums, double* derivatives)
+	{
 		const double twoE = 2. * E;
-		const double EpEta = twoE / eta;
+		const size_t stride = 2 * kTerms.nrLM;
+
+		// in a separate loop, so the divisions are vectorized, too
+		for (size_t n = 0; n < kTerms.nrBasisVectors; ++n)
+			inverseDenominators[n] = 1. / (twoE - kTerms.kn2[n]);
+
+		for (size_t i = 0; i < stride; ++i)
+			sums[i] = 0;
+
+		if (derivatives)
+		{
+			for (size_t i = 0; i < stride; ++i)
+				derivatives[i] = 0;
+		}
+
+		// all the L and M for a vector at once, the inner loops are over contiguous values, so they are vectorized
+		for (size_t n = 0; n < kTerms.nrBasisVectors; ++n)
+		{
+			const double inverseDenominator = inverseDenominators[n];
+			const double* terms = kTerms.ReciprocalTerms(n);
+
+			for (size_t i = 0; i < stride; ++i)
+				sums[i] += terms[i] * inverseDenominator;
+
+			if (derivatives)
+			{
+				// d/dE of 1 / (2E - |Kn + k|^2)
+				const double derivativeFactor = -2. * inverseDenominator * inverseDenominator;
 
+				for (size_t i = 0; i < stride; ++i)
+					derivatives[i] += terms[i] * derivativeFactor;
+			}
+		}
+	}
+
+	std::complex<double> LambdaBase::D(double E, int L, int M, const EwaldEnergyTerms& energyTerms)
+	{
+		assert(m_hasKPoint);
 
 		/*
 
@@ -63,17 +395,19 @@ namespace KKR
 		// without the full Ewald summation
 		// you don't need the real space vectors anymore
 		// but more vectors are needed in reciprocal space
-		// so comment out the GenerateBasisVectorsMaxSize(3, 1) line in BandStructureBasis
-		// and uncomment one that generates more vectors, like GenerateBasisVectorsMaxSize(8, 3) or higher
+		// so set larger cutoffs than the default ones in BandStructureBasis, with SetEwaldParameters
+		// like 8 for the reciprocal space and 3 for the real space, or higher
 		// the convergence is not very good especially for big energies
 		// I didn't play enough with this, so eta is probably far from optimum
 		// it also probably interferes with the code that tries to avoid spurious results due of singularities and so on
 
 
+		const double twoE = 2. * E;
+
 		std::complex<double> D(0, 0);
-		for (const auto& Kn : m_basisVectors)
+		for (size_t n = 0; n < m_basisVectors.GetSize(); ++n)
 		{
-			const Vector3D<double> kn = Kn + k;
+			const Vector3D<double> kn = Vector3D<double>(m_basisVectors.x[n], m_basisVectors.y[n], m_basisVectors.z[n]) + m_kTerms.k;
 			const double kn2 = kn * kn;
 			const double kn_length = sqrt(kn2);
 			const double Eminuskn2 = twoE - kn2;
@@ -101,70 +435,46 @@ namespace KKR
 
 		*/
 
-		// The three terms for Ewald summation:
-
-		// **************** first term ******************************************************************************************
-
-		std::complex<double> D1(0, 0);
-		for (const auto& Kn : m_basisVectors)
-		{
-			const Vector3D kn(Kn + k);
-			const double kn2 = kn * kn;
-			const double kn_length = sqrt(kn2);
-			const double Eminuskn2 = twoE - kn2;
+		// the same buffers as for ComputeDmap
+		m_inverseDenominators.resize(m_kTerms.nrBasisVectors);
+		m_reciprocalSums.resize(2 * m_kTerms.nrLM);
+		ComputeReciprocalSums(E, m_kTerms, m_inverseDenominators.data(), m_reciprocalSums.data(), nullptr);
 
-			const double theta = kn.getTheta();
-			const double phi = kn.getPhi();
-
-			const std::complex<double> Y = SpecialFunctions::Legendre::Y(L, M, theta, phi);
-
-			D1 += std::pow(kn_length, L) * std::exp(-kn2 * inveta) / Eminuskn2 * Y;
-		}
+		return D(L, M, m_kTerms, energyTerms, m_reciprocalSums.data(), nullptr, nullptr);
+	}
 
-		D1 *= 4. * M_PI * invCellVolume * kappamL * std::exp(EpEta);
+	std::complex<double> LambdaBase::D(double E, int L, int M, const EwaldEnergyTerms& energyTerms, std::complex<double>& derivative)
+	{
+		assert(m_hasKPoint && energyTerms.hasDerivatives);
 
+		m_inverseDenominators.resize(m_kTerms.nrBasisVectors);
+		m_reciprocalSums.resize(2 * m_kTerms.nrLM);
+		m_reciprocalSumDerivatives.resize(m_reciprocalSums.size());
+		ComputeReciprocalSums(E, m_kTerms, m_inverseDenominators.data(), m_reciprocalSums.data(), m_reciprocalSumDerivatives.data());
 
-		// **************** second term ******************************************************************************************
-
-		std::complex<double> D2(0, 0);
+		return D(L, M, m_kTerms, energyTerms, m_reciprocalSums.data(), m_reciprocalSumDerivatives.data(), &derivative);
+	}
 
-		double integral = 0;
-		double oldLength2 = 0;
-		const double twoLPlus1 = 2. * L + 1.;
+	std::complex<double> LambdaBase::D(int L, int M, const EwaldKPointTerms& kTerms, const EwaldEnergyTerms& energyTerms, const double* reciprocalSums, const double* reciprocalSumDerivatives, std::complex<double>* derivative)
+	{
+		// The three terms for Ewald summation:
+		// the parts that depend only on energy are in energyTerms, the ones that depend only on k in kTerms
 
-		for (const auto& Rn : m_realVectors)
-		{
-			const double rs2 = Rn * Rn;
-			const double rs = sqrt(rs2);
-			const double Ers2over2 = E * rs2 / 2.;
-			const double rs2eta4 = rs2 * eta / 4.;
-			
-
-			// the vectors are sorted by length
-			// calculate the integral only if the length changes
-			if (rs2 > oldLength2 + std::numeric_limits<double>::epsilon())
-			{
-				integral = 0;
-				for (int m = 0; m < 16; ++m)
-				{
-					const double term = std::pow(Ers2over2, m) / coeffs.Factorial(m) * SpecialFunctions::Gamma(0.5 + L - m, rs2eta4);
-					integral += term;
-					if (abs(term) < 1E-13) break;
-				}
-				integral *= 0.5 / std::pow(rs, twoLPlus1);
-			}
+		const int LM = EwaldKPointTerms::CompactIndex(L, M);
 
-			const double theta = Rn.getTheta();
-			const double phi = Rn.getPhi();
+		// **************** first term ******************************************************************************************
 
-			const std::complex<double> Y = SpecialFunctions::Legendre::Y(L, M, theta, phi);
+		const std::complex<double> sum1(reciprocalSums[2 * LM], reciprocalSums[2 * LM + 1]);
+		const std::complex<double> D1 = energyTerms.D1Prefactor[L] * sum1;
 
-			D2 += std::pow(rs, L) * std::exp(I * (k * Rn)) * Y * integral;
+		// **************** second term ******************************************************************************************
 
-			oldLength2 = rs2;
-		}
+		std::complex<double> sum2(0, 0);
+		const std::complex<double>* shellTerms = kTerms.ShellTerms(LM);
+		for (size_t shell = 0; shell < kTerms.nrShells; ++shell)
+			sum2 += shellTerms[shell] * energyTerms.Integral(L, shell);
 
-		D2 *= 1. / sqrt(M_PI) * std::pow(-2, L + 1) * iL * kappamL;
+		const std::complex<double> D2 = energyTerms.D2Prefactor[L] * sum2;
 
 		// **************** third term ******************************************************************************************
 
@@ -173,64 +483,128 @@ namespace KKR
 		{
 			assert(0 == M);
 
-			for (int s = 0; s < 16; ++s)
-			{
-				const double term = std::pow(EpEta, s) / ((2. * s - 1.) * coeffs.Factorial(s));
-				D3 += term;
-				if (abs(term) < 1E-13) break;
-			}
+			D3 = energyTerms.D3;
+		}
+
+		if (derivative)
+		{
+			// the derivatives of the sums and of the prefactors
+			assert(energyTerms.hasDerivatives);
 
-			D3 *= -0.5 * sqrt(eta) * M_1_PI;
+			const std::complex<double> dsum1(reciprocalSumDerivatives[2 * LM], reciprocalSumDerivatives[2 * LM + 1]);
+
+			std::complex<double> dsum2(0, 0);
+			for (size_t shell = 0; shell < kTerms.nrShells; ++shell)
+				dsum2 += shellTerms[shell] * energyTerms.IntegralDerivative(L, shell);
+
+			const std::complex<double> dD1 = energyTerms.D1PrefactorDerivative[L] * sum1 + energyTerms.D1Prefactor[L] * dsum1;
+			const std::complex<double> dD2 = energyTerms.D2PrefactorDerivative[L] * sum2 + energyTerms.D2Prefactor[L] * dsum2;
+			const double dD3 = 0 == L ? energyTerms.D3Derivative : 0.;
+
+			*derivative = dD1 + dD2 + dD3;
 		}
 
 		return D1 + D2 + D3;
 	}
 
+	void LambdaBase::ComputeDmap(double E, const Vector3D<double>& k, const EwaldEnergyTerms& energyTerms)
+	{
+		if (!m_hasKPoint || !(k == m_kTerms.k))
+			SetKPoint(k);
 
-	inline std::unordered_map<std::pair<int, int>, std::complex<double>, PairHash<int, int>> Lambda::ComputeDmap(double E, const Vector3D<double>& k, const CG::Coefficients& coeffs)
+		ComputeDmap(E, m_kTerms, energyTerms);
+	}
+
+	void LambdaBase::ComputeDmap(double E, const EwaldKPointTerms& kTerms, const EwaldEnergyTerms& energyTerms)
 	{
-		std::unordered_map<std::pair<int, int>, std::complex<double>, PairHash<int, int>> Dmap;
+		const bool derivatives = energyTerms.hasDerivatives;
+
+		// the first term for all L and M in a single pass over the reciprocal vectors
+		m_inverseDenominators.resize(kTerms.nrBasisVectors);
+		m_reciprocalSums.resize(2 * kTerms.nrLM);
+		if (derivatives) m_reciprocalSumDerivatives.resize(m_reciprocalSums.size());
+		ComputeReciprocalSums(E, kTerms, m_inverseDenominators.data(), m_reciprocalSums.data(), derivatives ? m_reciprocalSumDerivatives.data() : nullptr);
+
 		for (int L = 0; L <= 2 * m_lMax; ++L)
 		{
 			// first compute for the non negative M
+			// for the negative M, use the non negative value
 			for (int M = 0; M <= L; ++M)
 			{
-				const std::complex<double> Dval = D(E, k, L, M, coeffs);
-				if (Dval != std::complex<double>(0, 0))
-					Dmap[std::make_pair(L, M)] = Dval;
-			}
+				const double sign = (M % 2) ? -1. : 1.;
 
-			// for the negative M, use the non negative value already calculated
+				if (derivatives)
+				{
+					std::complex<double> derivative;
+					const std::complex<double> Dval = D(L, M, kTerms, energyTerms, m_reciprocalSums.data(), m_reciprocalSumDerivatives.data(), &derivative);
 
-			for (int M = -L; M < 0; ++M)
-			{
-				auto ind = std::make_pair(L, -M);
-				const auto it = Dmap.find(ind);
-				if (it != Dmap.end())
-					Dmap[std::make_pair(L, M)] = pow(-1, -M) * std::conj(it->second);
+					Dvalues[SphericalHarmonicsTable::Index(L, M)] = Dval;
+					DDerivatives[SphericalHarmonicsTable::Index(L, M)] = derivative;
+					if (M)
+					{
+						Dvalues[SphericalHarmonicsTable::Index(L, -M)] = sign * std::conj(Dval);
+						DDerivatives[SphericalHarmonicsTable::Index(L, -M)] = sign * std::conj(derivative);
+					}
+				}
+				else
+				{
+					const std::complex<double> Dval = D(L, M, kTerms, energyTerms, m_reciprocalSums.data(), nullptr, nullptr);
+
+					Dvalues[SphericalHarmonicsTable::Index(L, M)] = Dval;
+					if (M) Dvalues[SphericalHarmonicsTable::Index(L, -M)] = sign * std::conj(Dval);
+				}
 			}
 		}
+	}
+
+	void Lambda::Compute(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const EwaldEnergyTerms& energyTerms)
+	{
+		// precalculate D values
+		ComputeDmap(E, k, energyTerms);
 
-		return Dmap;
+		// the ratio derivatives are not used without the matrix derivative
+		ComputeMatrix<false>(ratios, ratios, energyTerms);
 	}
 
-	void Lambda::Compute(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const CG::Coefficients& coeffs)
+	void Lambda::Compute(double E, const EwaldKPointTerms& kTerms, const std::vector<double>& ratios, const EwaldEnergyTerms& energyTerms)
 	{
-		const std::complex<double> kappa((E >= 0 ? sqrt(2. * E) : 0), (E < 0 ? sqrt(-2. * E) : 0));
-		const std::complex<double> kappaR = kappa * m_R;
+		ComputeDmap(E, kTerms, energyTerms);
+		ComputeMatrix<false>(ratios, ratios, energyTerms);
+	}
 
-		// precalculate D values
-		std::unordered_map<std::pair<int, int>, std::complex<double>, PairHash<int, int>> Dmap = ComputeDmap(E, k, coeffs);
+	void Lambda::ComputeWithDerivative(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const std::vector<double>& ratioDerivatives)
+	{
+		ComputeEnergyTerms(E, offGridEnergyTerms, true);
+
+		ComputeDmap(E, k, offGridEnergyTerms);
+		ComputeMatrix<true>(ratios, ratioDerivatives, offGridEnergyTerms);
+	}
+
+	template<bool derivative> void Lambda::ComputeMatrix(const std::vector<double>& ratios, const std::vector<double>& ratioDerivatives, const EwaldEnergyTerms& energyTerms)
+	{
+		assert(!derivative || energyTerms.hasDerivatives);
+
+		const std::complex<double> kappa = energyTerms.kappa;
+		const std::complex<double> kappaR = kappa * m_R;
 
 		const std::complex<double> I(0, 1);
 
+		// at E = 0 the matrix is singular anyway, it's not scaled there
+		const double absKappa = abs(kappa);
+		const double scaleBase = absKappa > 0 ? absKappa : 1.;
+		logScale = 0;
+
 		int i = 0; // the index for l, m
 		for (int l = 0; l <= m_lMax; ++l)
 		{
-			const auto nderiv = SpecialFunctions::Bessel::nderiv(l, kappaR);
-			const auto jderiv = SpecialFunctions::Bessel::jderiv(l, kappaR);
-			const auto nval = SpecialFunctions::Bessel::n(l, kappaR);
-			const auto jval = SpecialFunctions::Bessel::j(l, kappaR);
+			const double lScale = std::pow(scaleBase, l);
+			scale.segment(l * l, 2 * l + 1).setConstant(lScale);
+			logScale += 2. * (2 * l + 1) * l * log(scaleBase);
+
+			const auto nderiv = energyTerms.besselNDerivative[l];
+			const auto jderiv = energyTerms.besselJDerivative[l];
+			const auto nval = energyTerms.besselN[l];
+			const auto jval = energyTerms.besselJ[l];
 			const auto kappanderiv = kappa * nderiv;
 			const auto kappajderiv = kappa * jderiv;
 
@@ -241,40 +615,52 @@ namespace KKR
 				for (int lp = l; lp <= m_lMax; ++lp)
 				{
 					const int lmlp = l - lp;
-					const int lplp = l + lp;
 
 					for (int mp = (lp == l ? m : -lp); mp <= lp; ++mp)
 					{
 						std::complex<double> A(0, 0);
-						const int mmp = m - mp;
+						std::complex<double> dA(0, 0);
 
-						for (int L = abs(lmlp); L <= lplp; L += 2)
+						// only the nonzero Gaunt coefficients are stored
+						for (const auto* entry = gaunt.Begin(i, j); entry != gaunt.End(i, j); ++entry)
 						{
-							//const int sumL = L + l + lp;
-							//if (sumL % 2) continue; // must be an even integer, no need to check it, the for above ensures the sum is even
-
-							const double C = coeffs.getCoefficient(l, lp, L, m, mp);
-							if (C != 0.)
-							{
-								const auto it = Dmap.find(std::make_pair(L, mmp));
-								if (it != Dmap.end())
-									A += it->second * C;
-							}
+							A += Dvalues[entry->LM] * entry->C;
+							if constexpr (derivative)
+								dA += DDerivatives[entry->LM] * entry->C;
 						}
 
-						A *= 4. * M_PI * std::pow(I, lmlp);
+						const std::complex<double> factor = 4. * M_PI * std::pow(I, lmlp);
+						A *= factor;
 
 						if (i == j)
 						{
 							const double logDeriv = ratios[l] - m_oneOverR;
 
-							const std::complex<double> ctgPhaseShift = (kappanderiv - nval * logDeriv) / (kappajderiv - jval * logDeriv);
+							const std::complex<double> numerator = kappanderiv - nval * logDeriv;
+							const std::complex<double> denominator = kappajderiv - jval * logDeriv;
+							const std::complex<double> ctgPhaseShift = numerator / denominator;
 							Lmat(i, i) = A + kappa * ctgPhaseShift;
+
+							if constexpr (derivative)
+							{
+								// dkappa/dE = 1 / kappa, the second derivatives of the Bessel functions are from their differential equation
+								const std::complex<double> lfactor = 1. - l * (l + 1.) / (kappaR * kappaR);
+								const std::complex<double> nderiv2 = -2. / kappaR * nderiv - lfactor * nval;
+								const std::complex<double> jderiv2 = -2. / kappaR * jderiv - lfactor * jval;
+								const double logDerivE = ratioDerivatives[l];
+
+								const std::complex<double> dnumerator = nderiv / kappa + m_R * nderiv2 - m_R / kappa * nderiv * logDeriv - nval * logDerivE;
+								const std::complex<double> ddenominator = jderiv / kappa + m_R * jderiv2 - m_R / kappa * jderiv * logDeriv - jval * logDerivE;
+								const std::complex<double> dctgPhaseShift = (dnumerator * denominator - numerator * ddenominator) / (denominator * denominator);
+
+								dLmat(i, i) = dA * factor + ctgPhaseShift / kappa + kappa * dctgPhaseShift;
+							}
 						}
 						else
 						{
 							Lmat(i, j) = A;
-							Lmat(j, i) = std::conj(A);
+							if constexpr (derivative)
+								dLmat(i, j) = dA * factor;
 						}
 
 						++j;
@@ -286,4 +672,4 @@ namespace KKR
 		}
 	}
 
-}
\ No newline at end of file
+}
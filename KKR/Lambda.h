@@ -1,75 +1,345 @@
 #pragma once
 
-#include <Eigen/eigen>
+#include <Eigen/Eigen>
 #include <vector>
+#include <cassert>
+#include <cmath>
+#include <limits>
 
 #include "SpecialFunctions.h"
 #include "Coefficients.h"
+#include "GauntTables.h"
 
 #include "Vector3D.h"
+#include "LatticeVectors.h"
+#include "EwaldParameters.h"
+#include "SphericalHarmonics.h"
 
 namespace KKR
 {
-	template <typename t1, typename t2> class PairHash {
+	// the parts of the Ewald summation from Lambda::D that depend only on energy, not on k
+	// they are computed once for each energy and shared by all k points (and threads)
+	class EwaldEnergyTerms
+	{
 	public:
-		size_t operator()(const std::pair<t1, t2>& p) const 
-		{
-			const auto h1 = std::hash<t1>{}(p.first);
-			const auto h2 = std::hash<t2>{}(p.second);
+		// the radial integral from the second term, already divided by rs^(L+1)
+		double Integral(int L, size_t shell) const { return integrals[L * nrShells + shell]; }
 
-			/*
-			// Cantor pairing
-			const unsigned long long int xy = h1 + h2;
-			const unsigned long long int prod = xy * (xy + 1);
+		std::vector<std::complex<double>> D1Prefactor; // indexed by L
+		std::vector<std::complex<double>> D2Prefactor; // indexed by L
+		double D3 = 0;
 
-			return static_cast<size_t>(0.5 * prod + h2);
-			*/
+		size_t nrShells = 0;
+		std::vector<double> integrals;
 
-			// Szudziks pairing is supposed to be better
-			if (h1 == std::max(h1, h2))
-				return h1 * h1 + h1 + h2;
+		// the energy derivatives of the above, computed only if asked for, they are needed for dLambda/dE
+		bool hasDerivatives = false;
 
-			return h2 * h2 + h1;
-		}
+		double IntegralDerivative(int L, size_t shell) const { return integralDerivatives[L * nrShells + shell]; }
+
+		std::vector<std::complex<double>> D1PrefactorDerivative;
+		std::vector<std::complex<double>> D2PrefactorDerivative;
+		double D3Derivative = 0;
+
+		std::vector<double> integralDerivatives;
+
+		// the free solutions at the muffin tin radius, for the diagonal of the matrix, indexed by l <= lMax
+		std::complex<double> kappa;
+		std::vector<std::complex<double>> besselJ;
+		std::vector<std::complex<double>> besselN;
+		std::vector<std::complex<double>> besselJDerivative;
+		std::vector<std::complex<double>> besselNDerivative;
 	};
 
 
-	class Lambda
+	// the parts of the Ewald summation from Lambda::D that depend only on k, not on energy
+	// they are computed once for each k point and reused for all energies
+	// only M >= 0 is kept, indexed with CompactIndex(L, M), the negative M values are obtained from them
+	class EwaldKPointTerms
 	{
 	public:
-		Lambda(const std::vector<Vector3D<double>>& basisVectors, const std::vector<Vector3D<double>>& realVectors, double R, double cellVolume, unsigned int lmax = 4)
-			: m_basisVectors(basisVectors), m_realVectors(realVectors), m_R(R), m_oneOverR(1. / R), m_cellVolume(cellVolume), m_lMax(lmax)
-		{
-			unsigned int dim = m_lMax + 1;
-			dim *= dim;
+		static int CompactIndex(int L, int M) { return L * (L + 1) / 2 + M; }
 
-			Lmat.resize(dim, dim);
-		}
+		// |Kn + k|^L exp(-|Kn + k|^2 / eta) Y_LM(Kn + k) for the vector, for all L and M, as pairs of real and imaginary parts
+		// the first term sums them divided by 2E - |Kn + k|^2, so all the L and M are summed together in a single pass over the vectors
+		const double* ReciprocalTerms(size_t n) const { return reciprocalTerms.data() + n * 2 * nrLM; }
 
-		bool IsCloseToPole(double E, const Vector3D<double>& k, double limit, const std::vector<double>& ratios, double limit2 = 1E-10) const;
-		std::complex<double> D(double E, const Vector3D<double>& k, int L, int M, const CG::Coefficients& coeffs) const;
-		inline std::unordered_map<std::pair<int, int>, std::complex<double>, PairHash<int, int>> ComputeDmap(double E, const Vector3D<double>& k, const CG::Coefficients& coeffs);
-		void Compute(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const CG::Coefficients& coeffs);
+		// exp(i k Rn) Y_LM(Rn) summed over each shell of real space vectors, the second term sums them multiplied by the shell integrals
+		const std::complex<double>* ShellTerms(int compactLM) const { return shellTerms.data() + compactLM * nrShells; }
 
-		std::complex<double> Determinant() const
-		{
-			return Lmat.determinant();
-			//return Lmat.fullPivLu().determinant();
-		}
+		Vector3D<double> k;
+		size_t nrLM = 0;
 
-	private:
+		size_t nrBasisVectors = 0;
+		std::vector<double> kn2; // |Kn + k|^2
+		std::vector<double> reciprocalTerms;
+
+		size_t nrShells = 0;
+		std::vector<std::complex<double>> shellTerms;
+	};
+
+
+	// the determinant as sign * exp(logAbs)
+	// the determinant itself overflows easily for larger lMax or close to the poles, this does not
+	class LogDeterminant
+	{
+	public:
+		LogDeterminant() = default;
+		LogDeterminant(double logAbs, int sign) : logAbs(logAbs), sign(sign) {}
+
+		// not valid if not computed or the radial solution blew up
+		bool IsValid() const { return sign != 0 && std::isfinite(logAbs); }
+
+		// the value scaled by exp(-logRef), use the same reference for values that are compared or interpolated
+		double Scaled(double logRef) const { return sign * exp(logAbs - logRef); }
+
+		double logAbs = std::numeric_limits<double>::quiet_NaN();
+		int sign = 0;
+
+		// the number of negative eigenvalues, from the signs of the LDL^T diagonal
+		// between poles it increases by one at each root, so it counts the roots in an energy interval
+		// -1 if the factorization was too ill conditioned for it
+		int negative = 0;
+
+		bool HasInertia() const { return negative >= 0; }
+	};
+
+
+	// the part of the KKR matrix computation that does not depend on the matrix size: the structure constants
+	class LambdaBase
+	{
+	public:
+		LambdaBase(const LatticeVectors& basisVectors, const LatticeVectors& realVectors, const SphericalHarmonicsTable& realHarmonics, double R, double cellVolume, const EwaldParameters& ewald, unsigned int lmax = 4);
+
+		// true if E is closer than limit / 2 to a pole of the free Green function
+		bool IsCloseToPole(double E, const Vector3D<double>& k, double limit) const;
+
+		// true if the cotangent of a phase shift has a pole between Ea and Eb, given the ratios of the radial solutions at both
+		// the pole is where its denominator kappa j_l' - j_l logDeriv changes sign, so the test does not depend on the scale of the Bessel functions,
+		// which for high l are tiny at small kappa R
+		bool HasPhaseShiftPole(double Ea, const std::vector<double>& ratiosA, double Eb, const std::vector<double>& ratiosB) const;
+
+		// true if there is a pole of the free Green function in [Ea, Eb], for the k point set with SetKPoint
+		// E = 0 counts as one, too, kappa vanishes there and the matrix is singular
+		bool HasPole(double Ea, double Eb) const;
+
+		// the energies of the poles in [Ea, Eb], as above, sorted
+		std::vector<double> GetPoles(double Ea, double Eb) const;
+
+		EwaldEnergyTerms ComputeEnergyTerms(double E, bool derivatives = false) const;
+
+		// the same, but fills terms computed before, their storage is reused, so this does not allocate
+		void ComputeEnergyTerms(double E, EwaldEnergyTerms& terms, bool derivatives = false) const;
+
+		// the incomplete gamma functions for the integrals from the second term, they depend only on the shell
+		// for each shell, Gamma(1/2 + n - (seriesTerms - 1), rs^2 eta / 4) for n = 0, ..., maxL + seriesTerms - 1
+		static std::vector<double> ComputeShellGammas(const std::vector<double>& shellLengths2, double eta, int maxL, int seriesTerms);
+
+		// the integral from the second term for a real space vector of length squared rs2, with the rs^L / (2 rs^(2L+1)) factor
+		// gammas is the table for its shell, from above, the series in energy is summed up to seriesTerms terms
+		// the energy derivative is computed only if the pointer is not null
+		static double RealSpaceIntegral(int L, double rs2, double E, int seriesTerms, const double* gammas, double* derivative = nullptr);
+
+		// computes the values that depend only on k, from the spherical harmonics for Kn + k, the Gaussian factors and the phases for the real space vectors
+		EwaldKPointTerms ComputeKPointTerms(const Vector3D<double>& k) const;
+
+		// keeps the k point terms, they are reused for all energies, ComputeDmap and Compute call it only when k changes
+		void SetKPoint(const Vector3D<double>& k);
+
+		// uses the k point set with SetKPoint
+		std::complex<double> D(double E, int L, int M, const EwaldEnergyTerms& energyTerms);
+
+		// the same, but also computes the energy derivative, the energy terms must have the derivatives
+		std::complex<double> D(double E, int L, int M, const EwaldEnergyTerms& energyTerms, std::complex<double>& derivative);
+
+		// computes D for all L <= 2 * lMax, they are stored in Dvalues
+		// if the energy terms have the derivatives, the derivatives of D are computed, too
+		void ComputeDmap(double E, const Vector3D<double>& k, const EwaldEnergyTerms& energyTerms);
+
+		// the same, for k point terms computed by the caller, the ones kept by SetKPoint are not changed
+		// this allows going over several k points for the same energy
+		void ComputeDmap(double E, const EwaldKPointTerms& kTerms, const EwaldEnergyTerms& energyTerms);
+		const std::complex<double>& GetD(int L, int M) const { return Dvalues[SphericalHarmonicsTable::Index(L, M)]; }
+		const std::complex<double>& GetDDerivative(int L, int M) const { return DDerivatives[SphericalHarmonicsTable::Index(L, M)]; }
+
+		int GetLMax() const { return m_lMax; }
+
+	protected:
 		// technically the basis vectors are Ki + k, those here are only Ki
-		const std::vector<Vector3D<double>>& m_basisVectors;
+		const LatticeVectors& m_basisVectors;
 
-		// real space vectors, needed for Ewald summation
-		const std::vector<Vector3D<double>>& m_realVectors;
+		// real space vectors, needed for Ewald summation, sorted by length, so they are grouped in shells of the same length
+		const LatticeVectors& m_realVectors;
 
 		const double m_R;
 		const double m_oneOverR; // used often in computations, so it's here for optimizations
 		const double m_cellVolume;
 		const int m_lMax;
+		const double m_eta;
+		const int m_seriesTerms;
+
+		// the incomplete gamma functions for the real space shells, see ComputeShellGammas
+		std::vector<double> m_shellGammas;
+
+		// Y_LM for the real space vectors, computed once for the whole computation
+		const SphericalHarmonicsTable& m_realHarmonics;
+
+		// the values for the current k point
+		bool m_hasKPoint = false;
+		EwaldKPointTerms m_kTerms;
+
+		// the sums from the first term for all the compact LM indices, as pairs of real and imaginary parts, and their energy derivatives
+		std::vector<double> m_reciprocalSums;
+		std::vector<double> m_reciprocalSumDerivatives;
+		std::vector<double> m_inverseDenominators; // 1 / (2E - |Kn + k|^2)
+
+		// kappa j_l' - j_l logDeriv, divided by i^l for negative energies, so it's real
+		double PhaseShiftDenominator(int l, double E, double ratio) const;
+
+		// the sums from the first term, without the prefactor, the derivatives are computed only if the pointer is not null
+		// inverseDenominators must have room for a value for each reciprocal vector
+		static void ComputeReciprocalSums(double E, const EwaldKPointTerms& kTerms, double* inverseDenominators, double* sums, double* derivatives);
+
+		// D from the sums from the first term and the other terms, the derivative is computed only if the pointer is not null
+		static std::complex<double> D(int L, int M, const EwaldKPointTerms& kTerms, const EwaldEnergyTerms& energyTerms, const double* reciprocalSums, const double* reciprocalSumDerivatives, std::complex<double>* derivative);
+
+		// the structure constants, indexed with SphericalHarmonicsTable::Index(L, M)
+		std::vector<std::complex<double>> Dvalues;
+		std::vector<std::complex<double>> DDerivatives;
+	};
+
+
+	// the KKR matrix
+	class Lambda : public LambdaBase
+	{
+	public:
+		using Matrix = Eigen::MatrixXcd;
+		using RealVector = Eigen::VectorXd;
+
+		Lambda(const LatticeVectors& basisVectors, const LatticeVectors& realVectors, const SphericalHarmonicsTable& realHarmonics, double R, double cellVolume, const EwaldParameters& ewald, unsigned int lmax = 4)
+			: LambdaBase(basisVectors, realVectors, realHarmonics, R, cellVolume, ewald, lmax), gaunt(CG::MakeGauntTable(m_lMax)),
+			factorization((m_lMax + 1) * (m_lMax + 1)), eigenSolver((m_lMax + 1) * (m_lMax + 1))
+		{
+			const int dim = (m_lMax + 1) * (m_lMax + 1);
+			Lmat.resize(dim, dim);
+			dLmat.resize(dim, dim);
+			fullMatrix.resize(dim, dim);
+			solution.resize(dim, dim);
+			scale.setOnes(dim);
+		}
+
+		// use this one if the energy terms are cached
+		void Compute(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const EwaldEnergyTerms& energyTerms);
+
+		// the k point terms are cached, too, for going over several k points for each energy
+		void Compute(double E, const EwaldKPointTerms& kTerms, const std::vector<double>& ratios, const EwaldEnergyTerms& energyTerms);
+
+		// the energy terms are computed in the ones kept for this, so it does not allocate
+		void Compute(double E, const Vector3D<double>& k, const std::vector<double>& ratios)
+		{
+			ComputeEnergyTerms(E, offGridEnergyTerms);
+			Compute(E, k, ratios, offGridEnergyTerms);
+		}
+
+		// also computes dLambda/dE, ratioDerivatives are the energy derivatives of the ratios
+		void ComputeWithDerivative(double E, const Vector3D<double>& k, const std::vector<double>& ratios, const std::vector<double>& ratioDerivatives);
+
+		// the matrix is hermitian, so the determinant is real
+		// an LDL^T factorization of the upper triangle is enough for it, the product of the diagonal D values
+		double Determinant()
+		{
+			Factorize();
+
+			return factorization.vectorD().real().prod() * exp(-logScale);
+		}
+
+		// the same factorization, but accumulates log |D| and the sign instead of the product
+		LogDeterminant LogDet()
+		{
+			Factorize();
+
+			LogDeterminant det(-logScale, 1);
+			if (factorization.info() != Eigen::Success)
+				det.negative = -1;
+
+			const auto D = factorization.vectorD().real();
+			for (int i = 0; i < D.size(); ++i)
+			{
+				det.logAbs += log(abs(D(i)));
+				if (D(i) < 0)
+				{
+					det.sign = -det.sign;
+					if (det.HasInertia()) ++det.negative;
+				}
+			}
+
+			// the count is not reliable if the pivots span more than the precision allows, the smallest ones have the wrong sign then
+			if (det.HasInertia() && D.size())
+			{
+				const double maxPivot = D.cwiseAbs().maxCoeff();
+				if (D.cwiseAbs().minCoeff() < maxPivot * maxPivotRange)
+					det.negative = -1;
+			}
+
+			return det;
+		}
+
+		// d ln|det| / dE = Tr(Lambda^-1 dLambda/dE), for the Newton steps
+		// uses the factorization, so call it after LogDet or Determinant, for a matrix computed with ComputeWithDerivative
+		// the factorization is of S Lambda S, so dLambda/dE is scaled the same way, the trace does not change
+		double LogDetDerivative()
+		{
+			fullMatrix = dLmat.selfadjointView<Eigen::Upper>();
+			fullMatrix = scale.asDiagonal() * fullMatrix * scale.asDiagonal();
+			solution = factorization.solve(fullMatrix);
+
+			return solution.trace().real();
+		}
+
+		// the eigenvalues of the hermitian matrix, in increasing order
+		// they are continuous in energy between the poles, so they can be tracked, a root is where one of them crosses zero
+		const RealVector& Eigenvalues()
+		{
+			fullMatrix = Lmat.selfadjointView<Eigen::Upper>();
+			eigenSolver.compute(fullMatrix, Eigen::EigenvaluesOnly);
+
+			return eigenSolver.eigenvalues();
+		}
+
+		// only the upper triangle is filled, use selfadjointView<Eigen::Upper>() on it
+		const Matrix& GetMatrix() const { return Lmat; }
+
+	private:
+		// the relative size of the smallest LDL^T pivot below which the count of the negative eigenvalues is not trusted
+		static constexpr double maxPivotRange = 1E-13;
+
+		// factorizes S Lambda S, S = diag(|kappa|^l), which has the same inertia and the determinant multiplied by exp(logScale)
+		// the phase shift cotangent goes as kappa^-2l and D_L as kappa^-L for small kappa, so for larger lMax the matrix
+		// spans too many orders of magnitude close to E = 0 for the inertia to be right without the scaling
+		void Factorize()
+		{
+			fullMatrix.noalias() = scale.asDiagonal() * Lmat * scale.asDiagonal();
+			factorization.compute(fullMatrix);
+		}
+
+		// from the D values computed already
+		template<bool derivative> void ComputeMatrix(const std::vector<double>& ratios, const std::vector<double>& ratioDerivatives, const EwaldEnergyTerms& energyTerms);
+
+		const CG::GauntTable gaunt;
+
+		Matrix Lmat;
+		Matrix dLmat; // dLambda/dE, only if computed with ComputeWithDerivative
+		Eigen::LDLT<Matrix, Eigen::Upper> factorization;
+		Eigen::SelfAdjointEigenSolver<Matrix> eigenSolver;
+
+		// the storage for the computations off the energy grid, reused for each of them
+		EwaldEnergyTerms offGridEnergyTerms;
+		Matrix fullMatrix; // both triangles, for the eigenvalues and the derivative of the determinant, or the scaled matrix that is factorized
+		Matrix solution;
 
-		Eigen::MatrixXcd Lmat;
+		// |kappa|^l for each row, set with the matrix, and the log of the product of their squares
+		RealVector scale;
+		double logScale = 0;
 	};
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+
+#include "Vector3D.h"
+
+namespace KKR {
+
+	// lattice vectors as a structure of arrays, so the loops over them (the Ewald sums) are vectorized by the compiler
+	// the vectors of the same length are grouped in shells, that makes sense only if they are sorted by length, as the real space vectors are
+	class LatticeVectors
+	{
+	public:
+		void Set(const std::vector<Vector3D<double>>& vectors)
+		{
+			const size_t size = vectors.size();
+
+			x.resize(size);
+			y.resize(size);
+			z.resize(size);
+			length2.resize(size);
+			shell.resize(size);
+			shellLengths2.clear();
+
+			for (size_t n = 0; n < size; ++n)
+			{
+				x[n] = vectors[n].X;
+				y[n] = vectors[n].Y;
+				z[n] = vectors[n].Z;
+				length2[n] = vectors[n] * vectors[n];
+
+				// a new shell starts when the length changes
+				if (0 == n || length2[n] > length2[n - 1] + std::numeric_limits<double>::epsilon())
+					shellLengths2.push_back(length2[n]);
+
+				shell[n] = shellLengths2.size() - 1;
+			}
+		}
+
+		size_t GetSize() const { return x.size(); }
+		size_t GetNrShells() const { return shellLengths2.size(); }
+
+		std::vector<double> x;
+		std::vector<double> y;
+		std::vector<double> z;
+		std::vector<double> length2;
+
+		std::vector<size_t> shell; // the shell of each vector
+		std::vector<double> shellLengths2;
+	};
+
+}
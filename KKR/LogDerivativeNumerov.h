@@ -0,0 +1,101 @@
+#pragma once
+
+#include <vector>
+
+#include "Numerov.h"
+
+namespace KKR {
+
+	// the renormalized Numerov method (B. R. Johnson, J. Chem. Phys. 69, 4678 (1978))
+	// instead of the solution, the ratio of consecutive values of w = (1 - h^2 f / 12) u is propagated, a discrete logarithmic derivative
+	// it doesn't overflow and the nodes of the solution are passed over, so it never bails out with infinity
+	// otherwise the results are the ones of the Numerov method, up to rounding
+	// the grid function and the steps are the ones of Numerov, but it's inherited privately: its other entry points,
+	// the batch and the energy derivative, solve for the solution itself, so only the ones below can be called
+	template<class NumerovFunction> class LogDerivativeNumerov : private Numerov<NumerovFunction>
+	{
+	public:
+		LogDerivativeNumerov(const Potential& pot, const RadialGrid& grid) : Numerov<NumerovFunction>(pot, grid) {}
+
+		inline double SolveSchrodinger(double endPoint, unsigned int l, double E, long int steps)
+		{
+			double ratio;
+			Solve(endPoint, l, l, E, steps, &ratio);
+
+			return ratio;
+		}
+
+		// all l <= lMax in a single pass over the grid
+		inline void SolveSchrodingerForAllL(double endPoint, unsigned int lMax, double E, long int steps, std::vector<double>& ratios)
+		{
+			ratios.resize(lMax + 1ULL);
+			Solve(endPoint, 0, lMax, E, steps, ratios.data());
+		}
+
+	private:
+		inline void Solve(double endPoint, unsigned int lFirst, unsigned int lLast, double E, long int steps, double* ratios)
+		{
+			this->SetSteps(endPoint, E, steps);
+
+			const double h = this->h;
+			const double h2 = this->h2;
+			const double h2p12 = this->h2p12;
+			const NumerovFunction& function = this->function;
+
+			const size_t nrL = lLast - lFirst + 1ULL;
+			lFactor.resize(nrL);
+			inverseRatio.resize(nrL);
+			funcVal.resize(nrL);
+			oldFuncVal.resize(nrL);
+
+			double potential;
+			double centrifugal;
+			double scale;
+			const double offset = function.GetOffset();
+
+			function.GetNodeTerms(h, 1, potential, centrifugal, scale);
+			for (size_t lane = 0; lane < nrL; ++lane)
+			{
+				const unsigned int l = lFirst + static_cast<unsigned int>(lane);
+				lFactor[lane] = l * (l + 1.);
+
+				funcVal[lane] = 2. * (potential + lFactor[lane] * centrifugal - E) * scale + offset;
+				oldFuncVal[lane] = funcVal[lane];
+
+				// w vanishes at the origin
+				inverseRatio[lane] = 0;
+			}
+
+			for (long int i = 2; i <= steps; ++i)
+			{
+				function.GetNodeTerms(h * i, i, potential, centrifugal, scale);
+
+				for (size_t lane = 0; lane < nrL; ++lane)
+				{
+					// the Numerov step divided by w(i - 1), with u = w / (1 - h^2 f / 12)
+					const double ratio = 2. - inverseRatio[lane] + h2 * funcVal[lane] / (1. - h2p12 * funcVal[lane]);
+					inverseRatio[lane] = 1. / ratio;
+
+					oldFuncVal[lane] = funcVal[lane];
+					funcVal[lane] = 2. * (potential + lFactor[lane] * centrifugal - E) * scale + offset;
+				}
+			}
+
+			// the same backward difference as Numerov returns, from u(N - 1) / u(N)
+			const double derivativeStep = function.GetDerivativeStep(steps, h);
+			const double wavefunctionRatio = function.GetWavefunctionValue(steps - 1ULL, 1.) / function.GetWavefunctionValue(steps, 1.);
+			for (size_t lane = 0; lane < nrL; ++lane)
+			{
+				const double solutionRatio = inverseRatio[lane] * (1. - h2p12 * funcVal[lane]) / (1. - h2p12 * oldFuncVal[lane]);
+
+				ratios[lane] = (1. - wavefunctionRatio * solutionRatio) / derivativeStep;
+			}
+		}
+
+		std::vector<double> lFactor;
+		std::vector<double> inverseRatio;
+		std::vector<double> funcVal;
+		std::vector<double> oldFuncVal;
+	};
+
+}
@@ -2,6 +2,10 @@
 
 #include <vector>
 #include <algorithm> 
+#include <cmath>
+#include <limits>
+
+#include "RadialGrid.h"
 
 namespace KKR {
 
@@ -17,7 +21,7 @@ namespace KKR {
 	class NumerovFunctionRegularGrid
 	{
 	public:
-		NumerovFunctionRegularGrid(const Potential& pot, double /*delta*/, double /*Rmax*/, size_t /*numPoints*/) : m_pot(pot) {}
+		NumerovFunctionRegularGrid(const Potential& pot, const RadialGrid& /*grid*/) : m_pot(pot) {}
 
 		inline double GetEffectivePotential(unsigned int l, double position, size_t posIndex) const
 		{
@@ -31,9 +35,23 @@ namespace KKR {
 			return  2. * (effectivePotential - E);
 		}
 
+		// the l independent parts of operator(), for solving all l channels in a single pass:
+		// operator() = 2 * (potential + l * (l + 1) * centrifugal - E) * scale + GetOffset()
+		inline void GetNodeTerms(double position, size_t posIndex, double& potential, double& centrifugal, double& scale) const
+		{
+			potential = m_pot(posIndex);
+			centrifugal = 0.5 / (position * position);
+			scale = 1.;
+		}
+
+		inline static double GetOffset()
+		{
+			return 0.;
+		}
+
 		inline static double GetBoundaryValueFar(double position, double E)
 		{
-			return exp(-position * sqrt(2. * abs(E)));
+			return exp(-position * sqrt(2. * std::abs(E)));
 		}
 
 		inline static double GetBoundaryValueZero(double position, unsigned int l)
@@ -51,9 +69,15 @@ namespace KKR {
 			return h;
 		}
 
+		// dr for the integrals over the grid
+		inline static double GetIntegrationStep(size_t /*posIndex*/, double h)
+		{
+			return h;
+		}
+
 		inline static double GetMaxRadius(double E, size_t /*maxIndex*/)
 		{
-			return 200. / sqrt(2. * abs(E));
+			return 200. / sqrt(2. * std::abs(E));
 		}
 
 		inline static double GetWavefunctionValue(size_t /*posIndex*/, double value)
@@ -74,60 +98,63 @@ namespace KKR {
 	class NumerovFunctionNonUniformGrid
 	{
 	public:
-		NumerovFunctionNonUniformGrid(const Potential& pot, double delta, double Rmax, size_t numPoints)
-			: m_pot(pot), m_delta(delta)
+		// the grid must outlive the function, the node values are taken from it
+		NumerovFunctionNonUniformGrid(const Potential& pot, const RadialGrid& grid)
+			: m_pot(pot), m_grid(grid), m_delta(grid.GetDelta()), Rp(grid.GetRp())
 		{
-			Rp = Rmax / (exp((numPoints - 1) * delta) - 1);
-			const double Rp2 = Rp * Rp;
-
-			twodelta = 2. * m_delta;
-			const double delta2 = m_delta * m_delta;
-
-			Rp2delta2 = Rp2 * delta2;
-			delta2p4 = delta2 * 0.25;
+			delta2p4 = m_delta * m_delta * 0.25;
+			logMaxRadiusLimit = log(MaxRadiusLimit);
 		}
 
-		inline double GetEffectivePotential(unsigned int l, double position, size_t posIndex) const
+		inline double GetEffectivePotential(unsigned int l, double /*position*/, size_t posIndex) const
 		{
-			position = GetPosition(posIndex); // the passed value is ignored, use the real one
-
-			return m_pot(posIndex) + l * (l + 1.) / (position * position) * 0.5;
+			// the passed position is ignored, use the real one
+			return m_pot(posIndex) + l * (l + 1.) * m_grid.GetInverseSquare(posIndex) * 0.5;
 		}
 
 		inline double operator()(unsigned int l, double E, double position, size_t posIndex) const
 		{
 			const double effectivePotential = GetEffectivePotential(l, position, posIndex);
 
-			return  2. * (effectivePotential - E) * Rp2delta2 * exp(posIndex * twodelta) + delta2p4;
+			return  2. * (effectivePotential - E) * m_grid.GetMetric(posIndex) + delta2p4;
 		}
 
-		inline double GetBoundaryValueFar(double position, double E) const
+		// all node values come from the grid, there are no exponentials computed in the Numerov loop
+		inline void GetNodeTerms(double /*position*/, size_t posIndex, double& potential, double& centrifugal, double& scale) const
 		{
-			const double realPosition = GetPosition(static_cast<int>(position));
+			potential = m_pot(posIndex);
+			centrifugal = 0.5 * m_grid.GetInverseSquare(posIndex);
+			scale = m_grid.GetMetric(posIndex);
+		}
 
-			return exp(-realPosition * sqrt(2. * abs(E)) - static_cast<int>(position) * m_delta * 0.5);
+		inline double GetOffset() const
+		{
+			return delta2p4;
+		}
+
+		inline double GetBoundaryValueFar(double position, double E) const
+		{
+			return exp(GetBoundaryExponentFar(static_cast<int>(position), E));
 		}
 
 		inline double GetBoundaryValueZero(double position, unsigned int l) const
 		{
 			const int posInd = static_cast<int>(position);
-			const double realPosition = GetPosition(posInd);
+			const double realPosition = m_grid.GetPosition(posInd);
 
-			return pow(realPosition, l + 1.) * exp(-position * m_delta * 0.5);
+			return pow(realPosition, l + 1.) / m_grid.GetHalfExp(posInd);
 		}
 
-
+		// the bisections compare the exponent of the far boundary value with the log of the limit, no exponentials needed
 		inline double GetMaxRadiusIndex(double E, size_t maxIndex, double /*stepSize*/) const
 		{
-			double val = GetBoundaryValueFar(static_cast<double>(maxIndex), E);
-			if (val > MaxRadiusLimit) static_cast<double>(maxIndex);
+			if (GetBoundaryExponentFar(maxIndex, E) > logMaxRadiusLimit) return static_cast<double>(maxIndex);
 
 			size_t minIndex = 1;
 			while (maxIndex - minIndex > 1)
 			{
 				const size_t midIndex = (maxIndex + minIndex) / 2;
-				val = GetBoundaryValueFar(static_cast<double>(midIndex), E);
-				if (val < MaxRadiusLimit)
+				if (GetBoundaryExponentFar(midIndex, E) < logMaxRadiusLimit)
 					maxIndex = midIndex;
 				else
 					minIndex = midIndex;
@@ -138,36 +165,22 @@ namespace KKR {
 
 		inline double GetMaxRadius(double E, size_t maxIndex) const
 		{
-			double val = GetBoundaryValueFar(static_cast<double>(maxIndex), E);
-			if (val > MaxRadiusLimit)
-			{
-				const double position = Rp * (exp(maxIndex * m_delta) - 1.);
-
-				return position;
-			}
-
-			size_t minIndex = 1;
-			while (maxIndex - minIndex > 1)
-			{
-				const size_t midIndex = (maxIndex + minIndex) / 2;
-				val = GetBoundaryValueFar(static_cast<double>(midIndex), E);
-				if (val < MaxRadiusLimit)
-					maxIndex = midIndex;
-				else
-					minIndex = midIndex;
-			}
-			
-			return Rp * (exp(maxIndex * m_delta) - 1.);
+			return m_grid.GetPosition(static_cast<size_t>(GetMaxRadiusIndex(E, maxIndex, 1)));
 		}
 
 		inline double GetDerivativeStep(int posIndex, double /*h*/) const
 		{
-			return Rp * exp(posIndex * m_delta) * (1. - exp(-m_delta));
+			return Rp * m_grid.GetExp(posIndex) * (1. - 1. / m_grid.GetExp(1));
 		}
 
 		inline double GetWavefunctionValue(size_t posIndex, double value) const
 		{
-			return exp(posIndex * m_delta * 0.5) * value;
+			return m_grid.GetHalfExp(posIndex) * value;
+		}
+
+		inline double GetIntegrationStep(size_t posIndex, double /*h*/) const
+		{
+			return Rp * m_delta * m_grid.GetExp(posIndex);
 		}
 
 		inline double GetRp() const { return Rp; }
@@ -179,19 +192,19 @@ namespace KKR {
 		}
 
 	private:
-		inline double GetPosition(size_t posIndex) const
+		inline double GetBoundaryExponentFar(size_t posIndex, double E) const
 		{
-			return Rp * (exp(posIndex * m_delta) - 1.);
+			return -m_grid.GetPosition(posIndex) * sqrt(2. * std::abs(E)) - posIndex * m_delta * 0.5;
 		}
 
 		const Potential& m_pot;
+		const RadialGrid& m_grid;
 
 		const double m_delta;
 
 		double Rp;
-		double twodelta;
 		double delta2p4;
-		double Rp2delta2;
+		double logMaxRadiusLimit;
 
 		static constexpr double MaxRadiusLimit = 1E-200;
 	};
@@ -200,29 +213,180 @@ namespace KKR {
 	template<class NumerovFunction> class Numerov
 	{
 	public:
-		Numerov(const Potential& pot, double delta = 0, double Rmax = 0, size_t numPoints = 0) : function(pot, delta, Rmax, numPoints), h(1), h2(1), h2p12(1. / 12.) {}
+		Numerov(const Potential& pot, const RadialGrid& grid) : function(pot, grid), h(1), h2(1), h2p12(1. / 12.) {}
 
 		inline double SolveSchrodinger(double endPoint, unsigned int l, double E, long int steps)
+		{
+			double ratioDerivative;
+
+			return Solve<false>(endPoint, l, E, steps, ratioDerivative);
+		}
+
+		// also computes the energy derivative of the returned ratio u'/u, from the norm of the solution:
+		// d(u'/u)/dE = -2 * integral of u^2 from 0 to the end point / u^2 at the end point
+		inline double SolveSchrodinger(double endPoint, unsigned int l, double E, long int steps, double& ratioDerivative)
+		{
+			return Solve<true>(endPoint, l, E, steps, ratioDerivative);
+		}
+
+		// solves for all l <= lMax in a single pass over the grid, the ratios are the ones SolveSchrodinger returns for each l
+		inline void SolveSchrodingerForAllL(double endPoint, unsigned int lMax, double E, long int steps, std::vector<double>& ratios)
+		{
+			SolveSchrodingerBatch(endPoint, lMax, &E, 1, steps, &ratios);
+		}
+
+		// solves for all l <= lMax at several energies in a single pass over the grid, ratios[e] gets the ratios for energies[e]
+		// the l independent terms are computed once for each node and each (energy, l) channel is a lane in contiguous arrays,
+		// so the inner loop has no dependencies between lanes and vectorizes
+		// a lane that blows up ends up infinite or NaN and stays that way, so it doesn't need an early exit, it's checked at the end
+		inline void SolveSchrodingerBatch(double endPoint, unsigned int lMax, const double* energies, size_t nrEnergies, long int steps, std::vector<double>* ratios)
+		{
+			SetStep(endPoint, steps);
+
+			const size_t nrL = lMax + 1ULL;
+			const size_t nrLanes = nrL * nrEnergies;
+
+			lFactor.resize(nrLanes);
+			laneEnergy.resize(nrLanes);
+			solution.resize(nrLanes);
+			oldSolution.resize(nrLanes);
+			w.resize(nrLanes);
+			wprev.resize(nrLanes);
+			funcVal.resize(nrLanes);
+			endSolution.resize(nrLanes);
+			endOldSolution.resize(nrLanes);
+
+			// the integration stops at the max radius for the energy, so the lanes end at different nodes
+			endSteps.resize(nrEnergies);
+			long int maxSteps = 1;
+			for (size_t e = 0; e < nrEnergies; ++e)
+			{
+				endSteps[e] = GetSteps(endPoint, energies[e], steps);
+				maxSteps = std::max(maxSteps, endSteps[e]);
+			}
+
+			double position = h;
+			double potential;
+			double centrifugal;
+			double scale;
+			const double offset = function.GetOffset();
+
+			function.GetNodeTerms(position, 1, potential, centrifugal, scale);
+			for (size_t e = 0, lane = 0; e < nrEnergies; ++e)
+				for (unsigned int l = 0; l <= lMax; ++l, ++lane)
+				{
+					lFactor[lane] = l * (l + 1.);
+					laneEnergy[lane] = energies[e];
+
+					solution[lane] = function.GetBoundaryValueZero(position, l);
+					oldSolution[lane] = 0;
+					funcVal[lane] = 2. * (potential + lFactor[lane] * centrifugal - laneEnergy[lane]) * scale + offset;
+					w[lane] = (1 - h2p12 * funcVal[lane]) * solution[lane];
+					wprev[lane] = 0;
+
+					endSolution[lane] = solution[lane];
+					endOldSolution[lane] = 0;
+				}
+
+			for (long int i = 2; i <= maxSteps; ++i)
+			{
+				position = h * i;
+				function.GetNodeTerms(position, i, potential, centrifugal, scale);
+
+				for (size_t lane = 0; lane < nrLanes; ++lane)
+				{
+					const double wnext = 2. * w[lane] - wprev[lane] + h2 * solution[lane] * funcVal[lane];
+
+					wprev[lane] = w[lane];
+					w[lane] = wnext;
+
+					funcVal[lane] = 2. * (potential + lFactor[lane] * centrifugal - laneEnergy[lane]) * scale + offset;
+
+					oldSolution[lane] = solution[lane];
+					solution[lane] = getU(w[lane], funcVal[lane]);
+				}
+
+				// the lanes that are done keep going, their values are saved here
+				for (size_t e = 0; e < nrEnergies; ++e)
+					if (endSteps[e] == i)
+						for (size_t lane = e * nrL; lane < (e + 1) * nrL; ++lane)
+						{
+							endSolution[lane] = solution[lane];
+							endOldSolution[lane] = oldSolution[lane];
+						}
+			}
+
+			for (size_t e = 0, lane = 0; e < nrEnergies; ++e)
+			{
+				ratios[e].resize(nrL);
+
+				const long int endStep = endSteps[e];
+				const double derivativeStep = function.GetDerivativeStep(endStep, h);
+				for (size_t l = 0; l < nrL; ++l, ++lane)
+				{
+					if (!std::isfinite(endSolution[lane]))
+					{
+						ratios[e][l] = std::numeric_limits<double>::infinity();
+						continue;
+					}
+
+					const double realSolution = function.GetWavefunctionValue(endStep, endSolution[lane]);
+					const double prevSolution = function.GetWavefunctionValue(endStep - 1ULL, endOldSolution[lane]);
+
+					ratios[e][l] = (realSolution - prevSolution) / (derivativeStep * realSolution);
+				}
+			}
+		}
+
+		NumerovFunction function;
+
+	protected:
+		inline void SetSteps(double endPoint, double E, long int& steps)
+		{
+			SetStep(endPoint, steps);
+			steps = GetSteps(endPoint, E, steps);
+		}
+
+		inline void SetStep(double endPoint, long int steps)
 		{
 			if (NumerovFunction::IsUniform())
 			{
 				h = endPoint / steps;
 				h2 = h * h;
 				h2p12 = h2 / 12.;
-
-				endPoint = std::min(endPoint, function.GetMaxRadius(E, steps));
-				steps = static_cast<long int>(endPoint / h);
 			}
 			else
 			{
 				h = 1;
 				h2 = 1;
 				h2p12 = 1. / 12.;
+			}
+		}
+
+		// the number of steps up to the max radius for the energy, the step must be already set
+		inline long int GetSteps(double endPoint, double E, long int steps) const
+		{
+			if (NumerovFunction::IsUniform())
+			{
+				endPoint = std::min(endPoint, function.GetMaxRadius(E, steps));
 
-				endPoint = std::min(endPoint, function.GetMaxRadiusIndex(E, steps, 1));
-				steps = static_cast<long int>(endPoint);
+				return static_cast<long int>(endPoint / h);
 			}
 
+			endPoint = std::min(endPoint, function.GetMaxRadiusIndex(E, steps, 1));
+
+			return static_cast<long int>(endPoint);
+		}
+
+		double h;
+		double h2;
+		double h2p12;
+
+	private:
+		template<bool derivative> inline double Solve(double endPoint, unsigned int l, double E, long int steps, double& ratioDerivative)
+		{
+			SetSteps(endPoint, E, steps);
+
 			double position = 0;
 			double solution = 0;
 			double wprev = 0;
@@ -234,6 +398,14 @@ namespace KKR {
 			double funcVal = function(l, E, position, 1);
 			double w = (1 - h2p12 * funcVal) * solution;
 
+			// trapezoidal rule, the solution is zero at the origin
+			double norm = 0;
+			if constexpr (derivative)
+			{
+				const double u = function.GetWavefunctionValue(1, solution);
+				norm = u * u * function.GetIntegrationStep(1, h);
+			}
+
 			for (long int i = 2; i <= steps; ++i)
 			{
 				const double wnext = 2. * w - wprev + h2 * solution * funcVal;
@@ -248,28 +420,47 @@ namespace KKR {
 				oldSolution = solution;
 				solution = getU(w, funcVal);
 
-				if (abs(solution) == std::numeric_limits<double>::infinity() || isnan(solution))
+				if (std::abs(solution) == std::numeric_limits<double>::infinity() || std::isnan(solution))
 					return std::numeric_limits<double>::infinity();
+
+				if constexpr (derivative)
+				{
+					const double u = function.GetWavefunctionValue(i, solution);
+					norm += u * u * function.GetIntegrationStep(i, h);
+				}
 			}
 			
 			const double realSolution = function.GetWavefunctionValue(steps, solution);
 			const double prevSolution = function.GetWavefunctionValue(steps - 1ULL, oldSolution);
 
+			if constexpr (derivative)
+			{
+				const double endValue2 = realSolution * realSolution;
+				norm -= 0.5 * endValue2 * function.GetIntegrationStep(steps, h);
+				// the returned ratio is a backward difference, u'/u - h/2 * u''/u to first order, with u''/u = 2(V - E)
+				ratioDerivative = -2. * norm / endValue2 + function.GetDerivativeStep(steps, h);
+			}
+
 			return (realSolution - prevSolution) / (function.GetDerivativeStep(steps, h) * realSolution);
 		}
 
-		NumerovFunction function;
-
-	private:
 		// 2.13
 		inline double getU(double w, double funcVal) const
 		{
 			return w / (1. - h2p12 * funcVal);
 		}
 
-		double h;
-		double h2;
-		double h2p12;
+		// the lanes for SolveSchrodingerBatch
+		std::vector<double> lFactor;
+		std::vector<double> laneEnergy;
+		std::vector<double> solution;
+		std::vector<double> oldSolution;
+		std::vector<double> w;
+		std::vector<double> wprev;
+		std::vector<double> funcVal;
+		std::vector<double> endSolution;
+		std::vector<double> endOldSolution;
+		std::vector<long int> endSteps;
 	};
 
 }
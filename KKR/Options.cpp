@@ -4,7 +4,7 @@
 
 
 Options::Options()
-	: nrThreads(4), nrPoints(400), pathNo(10),
+	: nrPoints(400), pathNo(10),
 	paths{ { 
 			{"K", "W", "X", "G", "L", "W"}, 
 			{"W", "G", "X", "W", "L", "G"}, 
@@ -59,6 +59,15 @@ void Options::Load()
 		nrThreads = conf->ReadLong("/nrThreads", 4);
 		nrPoints = conf->ReadLong("/nrPoints", 400);
 		pathNo = conf->ReadLong("/pathNo", 10);
+		adaptive = conf->ReadBool("/adaptive", false);
+		coarseSteps = conf->ReadLong("/coarseSteps", 8);
+		tolerance = conf->ReadDouble("/tolerance", 1E-7);
+		tracking = conf->ReadBool("/tracking", false);
+		newton = conf->ReadBool("/newton", false);
+		phaseShiftTable = conf->ReadBool("/phaseShiftTable", false);
+		logDerivative = conf->ReadBool("/logDerivative", false);
+		energyMajor = conf->ReadBool("/energyMajor", false);
+		ewaldTolerance = conf->ReadDouble("/ewaldTolerance", 0.);
 	}
 	Close();
 }
@@ -72,6 +81,15 @@ void Options::Save()
 		conf->Write("/nrThreads", static_cast<long int>(nrThreads));
 		conf->Write("/nrPoints", static_cast<long int>(nrPoints));
 		conf->Write("/pathNo", static_cast<long int>(pathNo));
+		conf->Write("/adaptive", adaptive);
+		conf->Write("/coarseSteps", static_cast<long int>(coarseSteps));
+		conf->Write("/tolerance", tolerance);
+		conf->Write("/tracking", tracking);
+		conf->Write("/newton", newton);
+		conf->Write("/phaseShiftTable", phaseShiftTable);
+		conf->Write("/logDerivative", logDerivative);
+		conf->Write("/energyMajor", energyMajor);
+		conf->Write("/ewaldTolerance", ewaldTolerance);
 	}
 
 	if (m_fileconfig)
@@ -7,7 +7,9 @@
 
 #include <wx/fileconf.h>
 
-class Options
+#include "ComputeOptions.h"
+
+class Options : public ComputeOptions
 {
 public:
 	Options();
@@ -19,8 +21,7 @@ public:
 
 	// avoid double deletion of m_fileconfig at destruction if copied
 	Options(const Options& other)
-		:
-		nrThreads(other.nrThreads),
+		: ComputeOptions(other),
 		nrPoints(other.nrPoints),
 		pathNo(other.pathNo),
 		paths(other.paths),
@@ -30,7 +31,7 @@ public:
 
 	Options& operator=(const Options& other)
 	{
-		nrThreads = other.nrThreads;
+		ComputeOptions::operator=(other);
 		nrPoints = other.nrPoints;
 		pathNo = other.pathNo;
 		paths = other.paths;
@@ -43,8 +44,6 @@ public:
 	void Load();
 	void Save();
 
-	int nrThreads;
-
 	int nrPoints;
 
 	int pathNo;
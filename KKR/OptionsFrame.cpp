@@ -13,6 +13,9 @@
 #define ID_NRTHREADS 101
 #define ID_NRPOINTS 103
 #define ID_PATH 104
+#define ID_COARSESTEPS 105
+#define ID_TOLERANCE 106
+#define ID_EWALDTOLERANCE 107
 
 wxDECLARE_APP(KKRApp);
 
@@ -21,6 +24,9 @@ OptionsFrame::OptionsFrame(const wxString& title, wxWindow* parent)
 {
 	CreateControls();
 
+	// there are more controls than the initial size fits
+	GetSizer()->Fit(this);
+
 	Centre();
 }
 
@@ -100,6 +106,75 @@ void OptionsFrame::CreateControls()
 
 	delete[] pathStrings;
 
+	box->AddSpacer(5);
+	boxSizer->AddSpacer(10);
+
+	// the modes of the band search, see ComputeOptions
+
+	wxFlexGridSizer* modesSizer = new wxFlexGridSizer(3, wxSize(10, 5));
+	boxSizer->Add(modesSizer, 0, wxGROW | wxLEFT, 10);
+
+	wxCheckBox* adaptiveCtrl = new wxCheckBox(this, wxID_ANY, "&Adaptive");
+	modesSizer->Add(adaptiveCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	wxCheckBox* trackingCtrl = new wxCheckBox(this, wxID_ANY, "T&racking");
+	modesSizer->Add(trackingCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	wxCheckBox* newtonCtrl = new wxCheckBox(this, wxID_ANY, "&Newton");
+	modesSizer->Add(newtonCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	wxCheckBox* phaseShiftTableCtrl = new wxCheckBox(this, wxID_ANY, "Phase shift ta&ble");
+	modesSizer->Add(phaseShiftTableCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	wxCheckBox* logDerivativeCtrl = new wxCheckBox(this, wxID_ANY, "&Log derivative");
+	modesSizer->Add(logDerivativeCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	wxCheckBox* energyMajorCtrl = new wxCheckBox(this, wxID_ANY, "&Energy major");
+	modesSizer->Add(energyMajorCtrl, 0, wxALIGN_CENTER_VERTICAL);
+
+	boxSizer->AddSpacer(10);
+
+	// next line
+
+	box = new wxBoxSizer(wxHORIZONTAL);
+	boxSizer->Add(box, 0, wxGROW , 5);
+
+	// coarse grid step for the adaptive mode
+
+	label = new wxStaticText(this, wxID_STATIC, "Coar&se step:", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+	box->Add(label, 0, wxALIGN_LEFT | wxALIGN_CENTER_VERTICAL | wxLEFT, 5);
+
+	wxTextCtrl* coarseStepsCtrl = new wxTextCtrl(this, ID_COARSESTEPS, wxEmptyString, wxDefaultPosition, wxSize(40, -1), 0);
+	box->Add(coarseStepsCtrl, 0, wxALIGN_CENTER_VERTICAL | wxLEFT, 5);
+
+	box->Add(5, 5, 1, wxALIGN_CENTER_VERTICAL , 5); // pushes to the right
+
+	// tolerance for the refined band energies
+
+	label = new wxStaticText(this, wxID_STATIC, "T&olerance:", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+	box->Add(label, 0, wxALIGN_RIGHT | wxALIGN_CENTER_VERTICAL , 5);
+
+	wxTextCtrl* toleranceCtrl = new wxTextCtrl(this, ID_TOLERANCE, wxEmptyString, wxDefaultPosition, wxSize(100, -1), 0);
+	box->Add(toleranceCtrl, 0, wxALIGN_CENTER_VERTICAL | wxLEFT, 5);
+
+	box->AddSpacer(5);
+	boxSizer->AddSpacer(5);
+
+	// next line
+
+	box = new wxBoxSizer(wxHORIZONTAL);
+	boxSizer->Add(box, 0, wxGROW , 5);
+
+	// tolerance for the Ewald sums, zero for the defaults
+
+	label = new wxStaticText(this, wxID_STATIC, "E&wald sums tolerance (0 for the defaults):", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+	box->Add(label, 0, wxALIGN_LEFT | wxALIGN_CENTER_VERTICAL | wxLEFT, 5);
+
+	box->Add(5, 5, 1, wxALIGN_CENTER_VERTICAL , 5); // pushes to the right
+
+	wxTextCtrl* ewaldToleranceCtrl = new wxTextCtrl(this, ID_EWALDTOLERANCE, wxEmptyString, wxDefaultPosition, wxSize(100, -1), 0);
+	box->Add(ewaldToleranceCtrl, 0, wxALIGN_CENTER_VERTICAL , 5);
+
 	box->AddSpacer(5);
 
 	// ******************************************************************
@@ -119,6 +194,27 @@ void OptionsFrame::CreateControls()
 
 	pathChoice->SetValidator(wxGenericValidator(&options.pathNo));
 
+	adaptiveCtrl->SetValidator(wxGenericValidator(&options.adaptive));
+	trackingCtrl->SetValidator(wxGenericValidator(&options.tracking));
+	newtonCtrl->SetValidator(wxGenericValidator(&options.newton));
+	phaseShiftTableCtrl->SetValidator(wxGenericValidator(&options.phaseShiftTable));
+	logDerivativeCtrl->SetValidator(wxGenericValidator(&options.logDerivative));
+	energyMajorCtrl->SetValidator(wxGenericValidator(&options.energyMajor));
+
+	wxIntegerValidator<int> val3(&options.coarseSteps, wxNUM_VAL_DEFAULT);
+	val3.SetRange(1, 100);
+	coarseStepsCtrl->SetValidator(val3);
+
+	// the tolerances are small, so they need many digits
+	// the minimum is checked elsewhere, as for the number of points
+	wxFloatingPointValidator<double> val4(12, &options.tolerance, wxNUM_VAL_NO_TRAILING_ZEROES);
+	val4.SetRange(0, 0.01);
+	toleranceCtrl->SetValidator(val4);
+
+	wxFloatingPointValidator<double> val5(12, &options.ewaldTolerance, wxNUM_VAL_NO_TRAILING_ZEROES);
+	val5.SetRange(0, 1);
+	ewaldToleranceCtrl->SetValidator(val5);
+
 
 	// ******************************************************************
 
@@ -157,6 +253,13 @@ bool OptionsFrame::TransferDataFromWindow()
 		return false;
 	}
 
+	if (options.tolerance <= 0)
+	{
+		wxMessageBox("Please enter a tolerance above zero", "Validation", wxOK | wxICON_INFORMATION, this);
+
+		return false;
+	}
+
 	return true;
 }
 
@@ -0,0 +1,133 @@
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include "PhaseShiftTable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace KKR {
+
+	void PhaseShiftTable::Compute(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, double Rmax, unsigned int l, double minE, double maxE, double maxStep, double tolerance)
+	{
+		m_l = l;
+		m_Rmax = Rmax;
+		m_nodes.clear();
+
+		const int nrSteps = std::max(1, static_cast<int>(ceil((maxE - minE) / maxStep)));
+		const double step = (maxE - minE) / nrSteps;
+
+		m_nodes.push_back(Solve(numerov, numerovIntervals, minE));
+		for (int i = 1; i <= nrSteps; ++i)
+		{
+			const Node a = m_nodes.back();
+			Refine(numerov, numerovIntervals, a, Solve(numerov, numerovIntervals, minE + i * step), tolerance, 0);
+		}
+	}
+
+	double PhaseShiftTable::GetRatio(double E) const
+	{
+		double ratioDerivative;
+
+		return GetRatio(E, ratioDerivative);
+	}
+
+	double PhaseShiftTable::GetRatio(double E, double& ratioDerivative) const
+	{
+		ratioDerivative = std::numeric_limits<double>::quiet_NaN();
+		if (!IsInRange(E) || m_nodes.size() < 2) return std::numeric_limits<double>::quiet_NaN();
+
+		auto it = std::upper_bound(m_nodes.begin(), m_nodes.end(), E, [](double e, const Node& node) { return e < node.E; });
+		if (it == m_nodes.end()) --it;
+
+		const Node& b = *it;
+		const Node& a = *(it - 1);
+		if (!a.IsValid() || !b.IsValid()) return std::numeric_limits<double>::quiet_NaN();
+
+		double angleDerivative;
+		const double angle = Interpolate(a, b, E, angleDerivative);
+
+		const double sinAngle = sin(angle);
+		ratioDerivative = -angleDerivative / (m_Rmax * sinAngle * sinAngle);
+
+		return cos(angle) / (m_Rmax * sinAngle);
+	}
+
+	PhaseShiftTable::Node PhaseShiftTable::Solve(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, double E) const
+	{
+		Node node;
+		node.E = E;
+
+		double ratioDerivative;
+		const double ratio = numerov.SolveSchrodinger(numerovIntervals, m_l, E, numerovIntervals, ratioDerivative);
+		if (!std::isfinite(ratio) || !std::isfinite(ratioDerivative))
+		{
+			node.angle = node.angleDerivative = std::numeric_limits<double>::quiet_NaN();
+			return node;
+		}
+
+		// cot(angle) = R u'/u, the angle is in (0, pi) here, it's unwrapped later
+		const double scaledRatio = m_Rmax * ratio;
+		node.angle = atan2(1., scaledRatio);
+		node.angleDerivative = -m_Rmax * ratioDerivative / (1. + scaledRatio * scaledRatio);
+
+		return node;
+	}
+
+	void PhaseShiftTable::Unwrap(Node& node, double predicted)
+	{
+		node.angle += M_PI * round((predicted - node.angle) / M_PI);
+	}
+
+	double PhaseShiftTable::Interpolate(const Node& a, const Node& b, double E, double& derivative)
+	{
+		const double h = b.E - a.E;
+		const double t = (E - a.E) / h;
+		const double t2 = t * t;
+		const double t3 = t2 * t;
+
+		derivative = ((6. * t2 - 6. * t) * (a.angle - b.angle)) / h + (3. * t2 - 4. * t + 1.) * a.angleDerivative + (3. * t2 - 2. * t) * b.angleDerivative;
+
+		return (2. * t3 - 3. * t2 + 1.) * a.angle + (t3 - 2. * t2 + t) * h * a.angleDerivative + (3. * t2 - 2. * t3) * b.angle + (t3 - t2) * h * b.angleDerivative;
+	}
+
+	// depth first, left to right, so the nodes are added in order and the left end is always unwrapped already
+	void PhaseShiftTable::Refine(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, const Node& a, Node b, double tolerance, int depth)
+	{
+		if (!a.IsValid() || !b.IsValid())
+		{
+			m_nodes.push_back(b);
+			return;
+		}
+
+		const double h = b.E - a.E;
+		Unwrap(b, a.angle + 0.5 * h * (a.angleDerivative + b.angleDerivative));
+
+		Node mid = Solve(numerov, numerovIntervals, 0.5 * (a.E + b.E));
+
+		bool split = !mid.IsValid() || b.angle - a.angle > maxAngleStep || h * std::max(a.angleDerivative, b.angleDerivative) > maxAngleStep;
+		if (mid.IsValid())
+		{
+			double derivative;
+			const double predicted = Interpolate(a, b, mid.E, derivative);
+			Unwrap(mid, predicted);
+
+			split = split || std::abs(mid.angle - predicted) > tolerance;
+		}
+
+		if (split && depth < maxDepth)
+		{
+			Refine(numerov, numerovIntervals, a, mid, tolerance, depth + 1);
+
+			const Node left = m_nodes.back();
+			Refine(numerov, numerovIntervals, left, b, tolerance, depth + 1);
+
+			return;
+		}
+
+		m_nodes.push_back(mid);
+		m_nodes.push_back(b);
+	}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+
+#include "Numerov.h"
+
+namespace KKR {
+
+	// the ratio u'/u at the muffin tin radius for one l, tabulated on an adaptive energy grid and interpolated in between
+	// the ratio has poles where u vanishes at the radius, so the angle theta with u'/u = cot(theta) / R is interpolated instead,
+	// it is smooth and it increases monotonically with the energy, since d(u'/u)/dE < 0
+	// the interpolation is cubic Hermite, with the derivatives from the energy derivative of the ratio, so the error goes with the fourth power of the step
+	class PhaseShiftTable
+	{
+	public:
+		// solves the radial equation on a grid refined until the interpolation error of the angle is below the tolerance
+		void Compute(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, double Rmax, unsigned int l, double minE, double maxE, double maxStep, double tolerance);
+
+		bool IsInRange(double E) const { return !m_nodes.empty() && E >= m_nodes.front().E && E <= m_nodes.back().E; }
+
+		// NaN outside the range or if the radial equation couldn't be solved at an end of the interval
+		double GetRatio(double E) const;
+		double GetRatio(double E, double& ratioDerivative) const;
+
+		size_t GetSize() const { return m_nodes.size(); }
+
+	private:
+		struct Node
+		{
+			double E = 0;
+			double angle = 0;
+			double angleDerivative = 0;
+
+			bool IsValid() const { return !std::isnan(angle); }
+		};
+
+		Node Solve(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, double E) const;
+
+		// the angle is known up to a multiple of pi, this picks the one closest to the predicted value
+		static void Unwrap(Node& node, double predicted);
+
+		static double Interpolate(const Node& a, const Node& b, double E, double& derivative);
+
+		void Refine(Numerov<NumerovFunctionNonUniformGrid>& numerov, int numerovIntervals, const Node& a, Node b, double tolerance, int depth);
+
+		// the max change of the angle between nodes, to be sure the unwrapping is right
+		static constexpr double maxAngleStep = 0.5;
+		static constexpr int maxDepth = 16;
+
+		unsigned int m_l = 0;
+		double m_Rmax = 1;
+
+		std::vector<Node> m_nodes;
+	};
+
+}
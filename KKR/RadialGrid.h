@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+
+namespace KKR {
+
+	// the non-uniform radial grid r = Rp * (exp(i * delta) - 1), with the last node at Rmax
+	// the values that depend only on the node are computed once, the grid is shared read only by the threads
+	class RadialGrid
+	{
+	public:
+		RadialGrid(double Rmax, double delta, size_t numPoints)
+			: m_delta(delta), m_Rmax(Rmax)
+		{
+			Rp = Rmax / (exp((numPoints - 1) * delta) - 1);
+			const double Rp2 = Rp * Rp;
+			const double delta2 = delta * delta;
+			const double Rp2delta2 = Rp2 * delta2;
+			const double twodelta = 2. * delta;
+
+			m_position.resize(numPoints);
+			m_inverseSquare.resize(numPoints);
+			m_exp.resize(numPoints);
+			m_halfExp.resize(numPoints);
+			m_metric.resize(numPoints);
+
+			for (size_t i = 0; i < numPoints; ++i)
+			{
+				m_exp[i] = exp(i * delta);
+				m_halfExp[i] = exp(i * delta * 0.5);
+				m_metric[i] = Rp2delta2 * exp(i * twodelta);
+
+				m_position[i] = Rp * (m_exp[i] - 1.);
+				m_inverseSquare[i] = 1. / (m_position[i] * m_position[i]);
+			}
+		}
+
+		inline size_t GetSize() const { return m_position.size(); }
+
+		inline double GetRp() const { return Rp; }
+		inline double GetDelta() const { return m_delta; }
+		inline double GetRmax() const { return m_Rmax; }
+
+		// r
+		inline double GetPosition(size_t posIndex) const { return m_position[posIndex]; }
+		// 1 / r^2, infinite at the origin
+		inline double GetInverseSquare(size_t posIndex) const { return m_inverseSquare[posIndex]; }
+		// exp(i * delta)
+		inline double GetExp(size_t posIndex) const { return m_exp[posIndex]; }
+		// exp(i * delta / 2), the factor between the Numerov solution and the wavefunction
+		inline double GetHalfExp(size_t posIndex) const { return m_halfExp[posIndex]; }
+		// Rp^2 * delta^2 * exp(2 * i * delta), the factor of the equation after the change of variable
+		inline double GetMetric(size_t posIndex) const { return m_metric[posIndex]; }
+
+	private:
+		const double m_delta;
+		const double m_Rmax;
+		double Rp;
+
+		std::vector<double> m_position;
+		std::vector<double> m_inverseSquare;
+		std::vector<double> m_exp;
+		std::vector<double> m_halfExp;
+		std::vector<double> m_metric;
+	};
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace KKR
+{
+
+	// Brent's method, used to refine the band energies bracketed on a coarse energy grid
+	// the function may return NaN if it cannot be evaluated somewhere, in that case NaN is returned
+	class RootFinding
+	{
+	public:
+		// the root of func in [a, b], fa and fb must have opposite signs
+		template<class Func> static double Brent(Func& func, double a, double b, double fa, double fb, double tolerance, int maxIter = 100)
+		{
+			double c = b;
+			double fc = fb;
+			double d = b - a;
+			double e = d;
+
+			for (int iter = 0; iter < maxIter; ++iter)
+			{
+				if ((fb > 0 && fc > 0) || (fb < 0 && fc < 0))
+				{
+					c = a;
+					fc = fa;
+					d = e = b - a;
+				}
+
+				// b is the best estimate
+				if (std::abs(fc) < std::abs(fb))
+				{
+					a = b;
+					b = c;
+					c = a;
+					fa = fb;
+					fb = fc;
+					fc = fa;
+				}
+
+				const double tol = 2. * std::numeric_limits<double>::epsilon() * std::abs(b) + 0.5 * tolerance;
+				const double xm = 0.5 * (c - b);
+				if (std::abs(xm) <= tol || 0 == fb) return b;
+
+				if (std::abs(e) >= tol && std::abs(fa) > std::abs(fb))
+				{
+					// inverse quadratic interpolation, or secant if only two points are available
+					double p;
+					double q;
+					const double s = fb / fa;
+					if (a == c)
+					{
+						p = 2. * xm * s;
+						q = 1. - s;
+					}
+					else
+					{
+						q = fa / fc;
+						const double r = fb / fc;
+						p = s * (2. * xm * q * (q - r) - (b - a) * (r - 1.));
+						q = (q - 1.) * (r - 1.) * (s - 1.);
+					}
+
+					if (p > 0) q = -q;
+					p = std::abs(p);
+
+					if (2. * p < std::min(3. * xm * q - std::abs(tol * q), std::abs(e * q)))
+					{
+						e = d;
+						d = p / q;
+					}
+					else
+					{
+						// bisection
+						d = xm;
+						e = d;
+					}
+				}
+				else
+				{
+					d = xm;
+					e = d;
+				}
+
+				a = b;
+				fa = fb;
+				b += std::abs(d) > tol ? d : (xm >= 0 ? tol : -tol);
+
+				fb = func(b);
+				if (std::isnan(fb)) return fb;
+			}
+
+			return b;
+		}
+	};
+
+}
@@ -5,7 +5,11 @@
 
 // you can use boost for the same purpose if spherical Bessel functions are not available
 
+#include <algorithm>
+#include <cmath>
 #include <complex>
+#include <limits>
+#include <vector>
 
 namespace SpecialFunctions
 {
@@ -40,6 +44,8 @@ namespace SpecialFunctions
 	public:
 		template<typename T> static T j(unsigned int l, const T& x)
 		{
+			if (UseSeries(l, x)) return jSeries(l, x);
+
 			const T sinxx = sin(x) / x;
 			const T cosxx = (0 == l) ? 0. : cos(x) / x;
 
@@ -56,6 +62,9 @@ namespace SpecialFunctions
 			//return T(l) / x * j(l, x) - j(l + 1, x);
 
 			// the above formula is ok, but this gets in one calculation both values needed for the derivative
+			// there's no cancellation in it for small x, so it's used with the series, too
+			if (UseSeries(l + 1, x)) return T(l) / x * j(l, x) - jSeries(l + 1, x);
+
 			const T sinxx = sin(x) / x;
 			const T cosxx = cos(x) / x;
 
@@ -95,6 +104,37 @@ namespace SpecialFunctions
 
 			return T(l) / x * n0 - n1;
 		}
+
+	private:
+		// the upward recursion is stable for n_l, but not for j_l if |x| is below about l, the errors grow there as n_l / j_l
+		// (for lMax = 5 and E close to zero nothing is left of j_l)
+		// the closed form for j_1 cancels for small x, too, so the power series is used for both, as in GSL
+		template<typename T> static bool UseSeries(unsigned int l, const T& x)
+		{
+			const double absx = std::abs(x);
+
+			return l > 0 && absx * absx < 10. * (l + 1.5) / M_E;
+		}
+
+		// j_l(x) = x^l / (2l+1)!! sum_k (-x^2/2)^k / (k! (2l+3)(2l+5)...(2l+2k+1))
+		template<typename T> static T jSeries(unsigned int l, const T& x)
+		{
+			T prefactor = 1.;
+			for (unsigned int i = 1; i <= l; ++i)
+				prefactor *= x / (2. * i + 1.);
+
+			const T mhalfx2 = -0.5 * x * x;
+			T term = 1.;
+			T sum = 1.;
+			for (unsigned int k = 1; k < 100; ++k)
+			{
+				term *= mhalfx2 / (k * (2. * l + 2. * k + 1.));
+				sum += term;
+				if (std::abs(term) < std::numeric_limits<double>::epsilon() * std::abs(sum)) break;
+			}
+
+			return prefactor * sum;
+		}
 	};
 
 	// Legendre polynomials
@@ -145,6 +185,103 @@ namespace SpecialFunctions
 		}
 	};
 
+	// all the spherical harmonics with l <= maxL for a direction, computed together
+	// uses the recurrence for the normalized associated Legendre functions and exp(i m phi) = exp(i (m - 1) phi) * exp(i phi)
+	// instead of calling std::sph_legendre and exp for each (l, m)
+	// same convention as Legendre::Y (including the Condon-Shortley phase)
+	class SphericalHarmonics
+	{
+	public:
+		explicit SphericalHarmonics(int maxL)
+			: m_maxL(maxL), a((maxL + 1ULL) * (maxL + 1ULL)), b((maxL + 1ULL) * (maxL + 1ULL)), diag(maxL + 1ULL), offDiag(maxL + 1ULL)
+		{
+			for (int m = 0; m <= maxL; ++m)
+			{
+				diag[m] = m ? -sqrt((2. * m + 1.) / (2. * m)) : 0.5 / sqrt(M_PI);
+				offDiag[m] = sqrt(2. * m + 3.);
+
+				for (int l = m + 2; l <= maxL; ++l)
+				{
+					const double l2 = static_cast<double>(l) * l;
+					const double m2 = static_cast<double>(m) * m;
+					const double lm1 = l - 1.;
+
+					a[Index(l, m)] = sqrt((4. * l2 - 1.) / (l2 - m2));
+					b[Index(l, m)] = sqrt((lm1 * lm1 - m2) / (4. * lm1 * lm1 - 1.));
+				}
+			}
+		}
+
+		static int Index(int l, int m) { return l * l + l + m; }
+
+		int GetMaxL() const { return m_maxL; }
+
+		// values must have room for (maxL + 1)^2 values, they are indexed with Index(l, m)
+		// the vector does not need to be normalized
+		void Compute(double x, double y, double z, std::complex<double>* values) const
+		{
+			const double rho2 = x * x + y * y;
+			const double r = sqrt(rho2 + z * z);
+			const double rho = sqrt(rho2);
+
+			double cosTheta = 1;
+			double sinTheta = 0;
+			if (r > 0)
+			{
+				cosTheta = z / r;
+				sinTheta = rho / r;
+			}
+
+			std::complex<double> expIPhi(1, 0);
+			if (rho > 0) expIPhi = std::complex<double>(x / rho, y / rho);
+
+			std::complex<double> expIMPhi(1, 0);
+			double pmm = 0.5 / sqrt(M_PI); // P_m^m, normalized
+
+			for (int m = 0; m <= m_maxL; ++m)
+			{
+				if (m)
+				{
+					pmm *= diag[m] * sinTheta;
+					expIMPhi *= expIPhi;
+				}
+
+				const double sign = (m % 2) ? -1. : 1.;
+
+				double p2 = pmm; // P_l^m
+				double p1 = 0; // P_(l-1)^m
+				for (int l = m; l <= m_maxL; ++l)
+				{
+					if (l == m + 1)
+					{
+						p1 = p2;
+						p2 = offDiag[m] * cosTheta * pmm;
+					}
+					else if (l > m + 1)
+					{
+						const int ind = Index(l, m);
+						const double p = a[ind] * (cosTheta * p2 - b[ind] * p1);
+						p1 = p2;
+						p2 = p;
+					}
+
+					const std::complex<double> Y = p2 * expIMPhi;
+					values[Index(l, m)] = Y;
+					if (m) values[Index(l, -m)] = sign * std::conj(Y);
+				}
+			}
+		}
+
+	private:
+		int m_maxL;
+
+		// recurrence coefficients
+		std::vector<double> a;
+		std::vector<double> b;
+		std::vector<double> diag;
+		std::vector<double> offDiag;
+	};
+
 
 
 #ifndef _GAMMA
@@ -160,4 +297,29 @@ namespace SpecialFunctions
 		return exp(-x) * pow(x, a) / (x - a + 1. + res);
 	}
 #endif
+
+	// the incomplete gamma function for a = aMin + n, n = 0, ..., count - 1, from Gamma(a + 1, x) = a Gamma(a, x) + x^a e^(-x)
+	// the continued fraction is used only for the a closest to -x, the recurrence is stable upwards from there and downwards below
+	// a must not be a non positive integer
+	inline void GammaTable(double aMin, int count, double x, double* values, int iter = 100)
+	{
+		const int seed = std::max(0, std::min(count - 1, static_cast<int>(std::lround(-x - aMin))));
+		values[seed] = Gamma(aMin + seed, x, iter);
+
+		const double seedPower = exp(-x) * pow(x, aMin + seed); // x^a e^(-x)
+
+		double power = seedPower;
+		for (int n = seed; n + 1 < count; ++n)
+		{
+			values[n + 1] = (aMin + n) * values[n] + power;
+			power *= x;
+		}
+
+		power = seedPower;
+		for (int n = seed; n > 0; --n)
+		{
+			power /= x;
+			values[n - 1] = (values[n] - power) / (aMin + n - 1.);
+		}
+	}
 }
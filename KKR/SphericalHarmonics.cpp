@@ -0,0 +1,25 @@
+#include "SphericalHarmonics.h"
+
+#include "SpecialFunctions.h"
+
+namespace KKR
+{
+
+	void SphericalHarmonicsTable::Compute(const std::vector<Vector3D<double>>& vectors, const Vector3D<double>& shift, int maxL)
+	{
+		m_maxL = maxL;
+		nrLM = (maxL + 1ULL) * (maxL + 1ULL);
+
+		values.resize(vectors.size() * nrLM);
+
+		const SpecialFunctions::SphericalHarmonics harmonics(maxL);
+
+		for (size_t n = 0; n < vectors.size(); ++n)
+		{
+			const Vector3D<double> v(vectors[n] + shift);
+
+			harmonics.Compute(v.X, v.Y, v.Z, values.data() + n * nrLM);
+		}
+	}
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <complex>
+#include <vector>
+
+#include "Vector3D.h"
+
+namespace KKR
+{
+
+	// Y_LM values for a set of vectors, for all L <= maxL and -L <= M <= L
+	// they depend only on the direction of the vectors, so they can be computed once and reused
+	class SphericalHarmonicsTable
+	{
+	public:
+		void Compute(const std::vector<Vector3D<double>>& vectors, int maxL)
+		{
+			Compute(vectors, Vector3D<double>(), maxL);
+		}
+
+		// the table is computed for the vectors + shift (for example for the reciprocal vectors + k)
+		void Compute(const std::vector<Vector3D<double>>& vectors, const Vector3D<double>& shift, int maxL);
+
+		const std::complex<double>& operator()(size_t vectorIndex, int L, int M) const
+		{
+			return values[vectorIndex * nrLM + Index(L, M)];
+		}
+
+		// all values for a vector, indexed with Index(L, M)
+		const std::complex<double>* GetValues(size_t vectorIndex) const
+		{
+			return values.data() + vectorIndex * nrLM;
+		}
+
+		static int Index(int L, int M) { return L * L + L + M; }
+
+		int GetMaxL() const { return m_maxL; }
+		size_t GetSize() const { return nrLM ? values.size() / nrLM : 0; }
+
+	private:
+		int m_maxL = -1;
+		size_t nrLM = 0;
+
+		std::vector<std::complex<double>> values;
+	};
+
+}
@@ -0,0 +1,219 @@
+#include "ThreadPool.h"
+
+namespace KKR {
+
+	namespace {
+
+		// the pool and the queue of the worker thread, null for the threads outside any pool
+		struct CurrentWorker
+		{
+			const ThreadPool* pool = nullptr;
+			size_t index = 0;
+		};
+
+		thread_local CurrentWorker currentWorker;
+
+	}
+
+	ThreadPool::ThreadPool(int nrThreads)
+	{
+		Start(nrThreads);
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		Stop();
+	}
+
+	void ThreadPool::SetThreads(int nrThreads)
+	{
+		if (nrThreads < 1) nrThreads = 1;
+		if (nrThreads == GetThreads()) return;
+
+		Stop();
+		Start(nrThreads);
+	}
+
+	void ThreadPool::Start(int nrThreads)
+	{
+		if (nrThreads < 1) nrThreads = 1;
+
+		m_stop = false;
+
+		m_queues.clear();
+		for (int i = 0; i < nrThreads; ++i)
+			m_queues.emplace_back(std::make_unique<Queue>());
+
+		for (int i = 1; i < nrThreads; ++i)
+			m_workers.emplace_back(&ThreadPool::WorkerLoop, this, static_cast<size_t>(i));
+	}
+
+	void ThreadPool::Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_stop = true;
+		}
+		m_wakeUp.notify_all();
+
+		for (auto& worker : m_workers)
+			worker.join();
+
+		m_workers.clear();
+	}
+
+	void ThreadPool::Submit(TaskGroup& group, std::function<void()> task)
+	{
+		++group.pending;
+
+		Queue& queue = *m_queues[GetQueueIndex()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(Task{ &group, std::move(task) });
+		}
+
+		++m_queued;
+
+		// taking the lock ensures a worker that is about to sleep sees the new task
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+		}
+		m_wakeUp.notify_one();
+	}
+
+	void ThreadPool::Wait(TaskGroup& group)
+	{
+		while (!group.IsDone())
+		{
+			if (RunGroupTask(group)) continue;
+
+			// the remaining tasks of the group are running on other threads
+			// they don't submit tasks to their own group, so there is nothing else to do for it
+			std::unique_lock<std::mutex> lock(m_doneMutex);
+			m_groupDone.wait(lock, [&group]() { return group.IsDone(); });
+		}
+
+		if (group.exception)
+			std::rethrow_exception(group.exception);
+	}
+
+	void ThreadPool::WorkerLoop(size_t index)
+	{
+		currentWorker.pool = this;
+		currentWorker.index = index;
+
+		for (;;)
+		{
+			if (RunTask(index)) continue;
+
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			m_wakeUp.wait(lock, [this]() { return m_stop || m_queued > 0; });
+
+			if (m_stop && 0 == m_queued) break;
+		}
+	}
+
+	size_t ThreadPool::GetQueueIndex() const
+	{
+		return currentWorker.pool == this ? currentWorker.index : 0;
+	}
+
+	bool ThreadPool::RunTask(size_t index)
+	{
+		Task task;
+		if (!Pop(index, task) && !Steal(index, task))
+			return false;
+
+		Run(task);
+
+		return true;
+	}
+
+	bool ThreadPool::RunGroupTask(const TaskGroup& group)
+	{
+		Task task;
+		if (!TakeGroupTask(group, task))
+			return false;
+
+		Run(task);
+
+		return true;
+	}
+
+	void ThreadPool::Run(Task& task)
+	{
+		--m_queued;
+
+		// the task is counted as done even if it throws, otherwise waiting for the group would never end
+		try
+		{
+			task.func();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(task.group->exceptionMutex);
+			if (!task.group->exception)
+				task.group->exception = std::current_exception();
+		}
+
+		// the group may be gone as soon as this is zero, it's the last access to it
+		if (0 == --task.group->pending)
+		{
+			// taking the lock ensures a thread that is about to wait for the group sees it done
+			{
+				std::lock_guard<std::mutex> lock(m_doneMutex);
+			}
+			m_groupDone.notify_all();
+		}
+	}
+
+	bool ThreadPool::Pop(size_t index, Task& task)
+	{
+		Queue& queue = *m_queues[index];
+
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) return false;
+
+		task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+
+		return true;
+	}
+
+	bool ThreadPool::Steal(size_t index, Task& task)
+	{
+		for (size_t i = 1; i < m_queues.size(); ++i)
+		{
+			Queue& queue = *m_queues[(index + i) % m_queues.size()];
+
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) continue;
+
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool ThreadPool::TakeGroupTask(const TaskGroup& group, Task& task)
+	{
+		for (auto& queue : m_queues)
+		{
+			std::lock_guard<std::mutex> lock(queue->mutex);
+
+			const auto it = std::find_if(queue->tasks.begin(), queue->tasks.end(), [&group](const Task& t) { return t.group == &group; });
+			if (it == queue->tasks.end()) continue;
+
+			task = std::move(*it);
+			queue->tasks.erase(it);
+
+			return true;
+		}
+
+		return false;
+	}
+
+}
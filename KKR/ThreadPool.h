@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <exception>
+
+namespace KKR {
+
+	// a persistent pool of threads, each with its own task queue
+	// a thread takes the last task from its own queue and steals the first one from the others when it runs out
+	// the thread that waits for a group of tasks runs tasks too, so with n threads there are n - 1 workers
+	// tasks may submit other tasks, those go to the queue of the thread that runs them
+	class ThreadPool
+	{
+	public:
+		class TaskGroup
+		{
+		public:
+			bool IsDone() const { return 0 == pending; }
+
+		private:
+			std::atomic<int> pending{ 0 };
+
+			// the first exception thrown by a task of the group, Wait rethrows it
+			std::mutex exceptionMutex;
+			std::exception_ptr exception;
+
+			friend class ThreadPool;
+		};
+
+		explicit ThreadPool(int nrThreads = 1);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		// the threads are started again only if the number changes, it must not be called while tasks are running
+		void SetThreads(int nrThreads);
+		int GetThreads() const { return static_cast<int>(m_workers.size()) + 1; }
+
+		void Submit(TaskGroup& group, std::function<void()> task);
+
+		// runs the tasks of the group until all are done, tasks of other groups are not run while waiting
+		// so a task can wait for another group, the data it needs, without nesting unrelated tasks on its stack
+		// when the remaining tasks of the group are running on other threads, it sleeps until they are done
+		// if a task of the group threw, the exception is rethrown after all of them are done
+		void Wait(TaskGroup& group);
+
+		// calls func(begin, end) for the subranges of [begin, end) with grain indices at most and waits for them
+		template<class Func> void ParallelFor(int begin, int end, int grain, const Func& func)
+		{
+			if (grain < 1) grain = 1;
+
+			TaskGroup group;
+			for (int start = begin; start < end; start += grain)
+			{
+				const int stop = std::min(start + grain, end);
+				Submit(group, [&func, start, stop]() { func(start, stop); });
+			}
+
+			Wait(group);
+		}
+
+	private:
+		struct Task
+		{
+			TaskGroup* group;
+			std::function<void()> func;
+		};
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		void Start(int nrThreads);
+		void Stop();
+
+		void WorkerLoop(size_t index);
+
+		// the queue of the calling thread, the first one for the threads that are not workers of this pool
+		size_t GetQueueIndex() const;
+
+		bool RunTask(size_t index);
+		bool RunGroupTask(const TaskGroup& group);
+		void Run(Task& task);
+
+		bool Pop(size_t index, Task& task);
+		bool Steal(size_t index, Task& task);
+		// the oldest task of the group, from any queue
+		bool TakeGroupTask(const TaskGroup& group, Task& task);
+
+		// the first queue is for the threads outside the pool
+		std::vector<std::unique_ptr<Queue>> m_queues;
+		std::vector<std::thread> m_workers;
+
+		std::mutex m_sleepMutex;
+		std::condition_variable m_wakeUp;
+
+		// signalled when the last task of a group is done, the groups can be gone by then, so it's not theirs
+		std::mutex m_doneMutex;
+		std::condition_variable m_groupDone;
+		std::atomic<int> m_queued{ 0 };
+		bool m_stop = false;
+	};
+
+}
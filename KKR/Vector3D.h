@@ -1,6 +1,7 @@
 #pragma once
 
 #include <tuple>
+#include <cmath>
 
 template<typename T = double> class Vector3D
 {
@@ -43,7 +44,7 @@ public:
 		if (0 == X && 0 == Y && 0 == Z) return 0; // special case
 
 		double cosTheta = Z / Length();
-		if (isnan(cosTheta) || isinf(cosTheta) || cosTheta > 1. || cosTheta < -1) cosTheta = (Z < 0 ? -1 : 1);
+		if (std::isnan(cosTheta) || std::isinf(cosTheta) || cosTheta > 1. || cosTheta < -1) cosTheta = (Z < 0 ? -1 : 1);
 		
 		return acos(cosTheta);
 	}
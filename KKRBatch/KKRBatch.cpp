@@ -0,0 +1,203 @@
+// command line driver for the band structure computation
+// it does not need wxWidgets or VTK, so it can be used for batch jobs
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "BandStructure.h"
+
+namespace {
+
+	void PrintUsage(const char* name)
+	{
+		std::cerr << "Usage: " << name << " [options]\n"
+			<< "  -p, --path <points>    symmetry points path, for example GXWLGK or G,X,W,L,G,K (default GXWLGK)\n"
+			<< "  -n, --points <n>       number of k points along the path (default 400)\n"
+			<< "  -l, --lmax <n>         maximum angular momentum (default 2)\n"
+			<< "  -t, --threads <n>      number of threads (default 4)\n"
+			<< "      --emin <E>         lower limit of the energy window, in Hartree (default -0.05)\n"
+			<< "      --emax <E>         upper limit of the energy window, in Hartree (default 0.8)\n"
+			<< "  -a, --adaptive         scan on a coarse energy grid and refine the band energies with Brent's method\n"
+			<< "      --tracking         follow the eigenvalues of the KKR matrix, with a variable energy step, instead of the determinant\n"
+			<< "      --newton           refine the band energies interpolated on the grid with Newton steps\n"
+			<< "      --table            interpolate the radial solutions from a table computed on an adaptive energy grid\n"
+			<< "      --logderivative    solve the radial equation with the renormalized Numerov method, which cannot overflow\n"
+			<< "      --energymajor      scan the grid energy by energy, for several k points at once\n"
+			<< "      --coarse <n>       the coarse grid step for the adaptive mode, in steps of 1E-3 Hartree (default 8)\n"
+			<< "      --tolerance <E>    tolerance for the refined band energies, in Hartree (default 1E-7)\n"
+			<< "      --ewaldtol <t>     choose the Ewald parameter and the lattice sums for this error of the structure constants\n"
+			<< "  -o, --output <file>    write the bands to the file instead of stdout\n"
+			<< "  -h, --help             show this message\n";
+	}
+
+	// symmetry points have single letter names, separators are ignored
+	// returns an empty path if an unknown point is encountered
+	std::vector<std::string> ParsePath(const std::string& str)
+	{
+		static const std::string knownPoints = "LGXWKU";
+
+		std::vector<std::string> path;
+
+		for (const char c : str)
+		{
+			if (c == ',' || c == '-' || c == ' ') continue;
+			else if (knownPoints.find(c) == std::string::npos) return {};
+
+			path.emplace_back(1, c);
+		}
+
+		return path;
+	}
+
+	void WriteResults(std::ostream& out, const KKR::BandStructure& bandStructure)
+	{
+		const auto& path = bandStructure.GetPath();
+
+		out << "# path:";
+		for (const auto& point : path)
+			out << " " << point;
+		out << "\n# symmetry points positions:";
+		for (size_t i = 0; i < bandStructure.symmetryPointsPositions.size() && i < path.size(); ++i)
+			out << " " << path[i] << "=" << bandStructure.symmetryPointsPositions[i];
+		const KKR::EwaldParameters& ewald = bandStructure.GetEwaldParameters();
+		out << "\n# Ewald sums: eta=" << ewald.eta << ", " << bandStructure.GetBasisVectors().size() << " reciprocal and " << bandStructure.GetRealVectors().size() << " real space vectors, " << ewald.seriesTerms << " terms in energy";
+		out << "\n# k index, then the band energies (Hartree)\n";
+
+		out << std::setprecision(10);
+		for (size_t k = 0; k < bandStructure.results.size(); ++k)
+		{
+			out << k;
+			for (const double E : bandStructure.results[k])
+				out << " " << E;
+			out << "\n";
+		}
+	}
+
+}
+
+int main(int argc, char* argv[])
+{
+	ComputeOptions options;
+	std::string pathStr = "GXWLGK";
+	int nrPoints = 400;
+	int lMax = 2;
+	std::string outFile;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+
+		if (arg == "-h" || arg == "--help")
+		{
+			PrintUsage(argv[0]);
+			return 0;
+		}
+		else if (arg == "-a" || arg == "--adaptive")
+		{
+			options.adaptive = true;
+			continue;
+		}
+		else if (arg == "--tracking")
+		{
+			options.tracking = true;
+			continue;
+		}
+		else if (arg == "--newton")
+		{
+			options.newton = true;
+			continue;
+		}
+		else if (arg == "--table")
+		{
+			options.phaseShiftTable = true;
+			continue;
+		}
+		else if (arg == "--logderivative")
+		{
+			options.logDerivative = true;
+			continue;
+		}
+		else if (arg == "--energymajor")
+		{
+			options.energyMajor = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << "\n";
+			PrintUsage(argv[0]);
+			return 1;
+		}
+
+		const std::string val = argv[++i];
+
+		try
+		{
+			if (arg == "-p" || arg == "--path") pathStr = val;
+			else if (arg == "-n" || arg == "--points") nrPoints = std::stoi(val);
+			else if (arg == "-l" || arg == "--lmax") lMax = std::stoi(val);
+			else if (arg == "-t" || arg == "--threads") options.nrThreads = std::stoi(val);
+			else if (arg == "--emin") options.minE = std::stod(val);
+			else if (arg == "--emax") options.maxE = std::stod(val);
+			else if (arg == "--coarse") options.coarseSteps = std::stoi(val);
+			else if (arg == "--tolerance") options.tolerance = std::stod(val);
+			else if (arg == "--ewaldtol") options.ewaldTolerance = std::stod(val);
+			else if (arg == "-o" || arg == "--output") outFile = val;
+			else
+			{
+				std::cerr << "Unknown option " << arg << "\n";
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+		catch (...)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << val << "\n";
+			return 1;
+		}
+	}
+
+	if (options.nrThreads < 1) options.nrThreads = 1;
+	if (options.coarseSteps < 1) options.coarseSteps = 1;
+	if (options.tolerance <= 0) options.tolerance = 1E-7;
+
+	const std::vector<std::string> path = ParsePath(pathStr);
+	if (path.size() < 2 || options.maxE <= options.minE || nrPoints < 1 || lMax < 0)
+	{
+		std::cerr << "Invalid path, number of points, lMax or energy window\n";
+		return 1;
+	}
+
+	KKR::BandStructure bandStructure;
+	bandStructure.Initialize(path, nrPoints, lMax);
+
+	if (bandStructure.GetPointsNumber() == 0)
+	{
+		std::cerr << "Too few points for the path\n";
+		return 1;
+	}
+
+	const std::atomic_bool terminate(false);
+	bandStructure.results = bandStructure.Compute(terminate, options);
+
+	if (outFile.empty())
+		WriteResults(std::cout, bandStructure);
+	else
+	{
+		std::ofstream out(outFile);
+		if (!out)
+		{
+			std::cerr << "Cannot open " << outFile << "\n";
+			return 1;
+		}
+
+		WriteResults(out, bandStructure);
+	}
+
+	return 0;
+}
@@ -0,0 +1,477 @@
+// benchmarks for the hot parts of the KKR computation
+// each kernel is timed in isolation on inputs generated with a fixed seed,
+// then the whole band structure computation is timed for several numbers of threads
+// the results are printed and optionally written as json, to be able to compare them between commits
+// with --check it compares instead the bands found by the grid scan and by the adaptive mode, for larger lMax
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <complex>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BandStructure.h"
+#include "Lambda.h"
+#include "Numerov.h"
+#include "LogDerivativeNumerov.h"
+#include "PhaseShiftTable.h"
+
+namespace {
+
+	struct BenchmarkResult
+	{
+		std::string name;
+		int threads = 1;
+		long long int calls = 0;
+		double seconds = 0;
+
+		double NanosecondsPerCall() const { return calls ? seconds * 1E9 / calls : 0; }
+		double CallsPerSecond() const { return seconds > 0 ? calls / seconds : 0; }
+	};
+
+	// the compiler is not allowed to drop the computations whose results go in here
+	volatile double sink = 0;
+
+	// calls func(i) with an increasing index until at least minTime seconds passed
+	template<class Func> BenchmarkResult Run(const std::string& name, double minTime, Func&& func)
+	{
+		BenchmarkResult res;
+		res.name = name;
+
+		long long int batch = 1;
+		const auto start = std::chrono::steady_clock::now();
+		for (;;)
+		{
+			for (long long int i = 0; i < batch; ++i)
+				func(res.calls + i);
+
+			res.calls += batch;
+			res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (res.seconds >= minTime) break;
+
+			batch *= 2;
+		}
+
+		return res;
+	}
+
+	void Print(const BenchmarkResult& res)
+	{
+		std::cout << std::left << std::setw(46) << res.name << " threads: " << std::setw(3) << res.threads
+			<< std::right << std::setw(14) << std::fixed << std::setprecision(1) << res.NanosecondsPerCall() << " ns/call"
+			<< std::setw(16) << std::setprecision(1) << res.CallsPerSecond() << " calls/s"
+			<< std::setw(12) << res.calls << " calls" << std::endl;
+	}
+
+	void WriteJson(const std::string& fileName, const std::vector<BenchmarkResult>& results, unsigned int seed, int nrPoints)
+	{
+		std::ofstream out(fileName);
+		if (!out)
+		{
+			std::cerr << "Cannot open " << fileName << std::endl;
+			return;
+		}
+
+		out << std::setprecision(10);
+		out << "{\n  \"seed\": " << seed << ",\n  \"nrPoints\": " << nrPoints << ",\n  \"benchmarks\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const auto& res = results[i];
+			out << "    { \"name\": \"" << res.name << "\", \"threads\": " << res.threads
+				<< ", \"calls\": " << res.calls << ", \"seconds\": " << res.seconds
+				<< ", \"ns_per_call\": " << res.NanosecondsPerCall() << ", \"calls_per_second\": " << res.CallsPerSecond() << " }"
+				<< (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n}\n";
+	}
+
+	std::vector<int> ParseList(const std::string& str)
+	{
+		std::vector<int> vals;
+		std::istringstream stream(str);
+		std::string item;
+		while (std::getline(stream, item, ','))
+			if (!item.empty()) vals.push_back(std::stoi(item));
+
+		return vals;
+	}
+
+	// the number of bands from the first set without one from the second closer than tolerance, for all the k points
+	int CountUnmatched(const std::vector<std::vector<double>>& bands, const std::vector<std::vector<double>>& other, double tolerance)
+	{
+		int count = 0;
+		for (size_t k = 0; k < bands.size() && k < other.size(); ++k)
+			for (const double E : bands[k])
+				if (std::none_of(other[k].begin(), other[k].end(), [E, tolerance](double otherE) { return abs(otherE - E) < tolerance; }))
+					++count;
+
+		return count;
+	}
+
+	// the adaptive mode relies on the count of the negative eigenvalues and the grid scan on the sign changes and the poles
+	// so they fail differently if the matrix gets ill conditioned, as it does for larger lMax close to E = 0
+	// the bands found by each of them must be found by the other one, too, within the grid step (the grid scan interpolates)
+	// except for a few the grid scan misses, too close to a pole or to the end of the window, or a pair closer than the step
+	bool CheckLMax(const std::vector<std::string>& path, int nrPoints, const std::vector<int>& lMaxs)
+	{
+		bool ok = true;
+		for (const int lMax : lMaxs)
+		{
+			KKR::BandStructure bandStructure;
+			bandStructure.Initialize(path, nrPoints, lMax);
+
+			const std::atomic_bool terminate(false);
+
+			ComputeOptions options;
+			const auto gridBands = bandStructure.Compute(terminate, options);
+
+			options.adaptive = true;
+			const auto adaptiveBands = bandStructure.Compute(terminate, options);
+
+			size_t gridCount = 0;
+			size_t adaptiveCount = 0;
+			for (size_t k = 0; k < gridBands.size(); ++k)
+			{
+				gridCount += gridBands[k].size();
+				adaptiveCount += adaptiveBands[k].size();
+			}
+
+			const double tolerance = 2E-3; // twice the energy step of the grid
+			const int notInAdaptive = CountUnmatched(gridBands, adaptiveBands, tolerance);
+			const int notInGrid = CountUnmatched(adaptiveBands, gridBands, tolerance);
+
+			std::cout << "lMax " << lMax << ": grid " << gridCount << " bands, adaptive " << adaptiveCount << " bands, "
+				<< notInAdaptive << " not found by the adaptive mode, " << notInGrid << " not found by the grid scan" << std::endl;
+
+			if (notInAdaptive > 0.01 * gridCount || notInGrid > 0.01 * adaptiveCount) ok = false;
+		}
+
+		return ok;
+	}
+
+	void PrintUsage(const char* name)
+	{
+		std::cerr << "Usage: " << name << " [options]\n"
+			<< "  -n, --points <n>        number of k points for the full computation (default 50)\n"
+			<< "  -t, --threads <list>    comma separated numbers of threads for the full computation (default 1,2,4)\n"
+			<< "      --time <seconds>    minimum time spent in each kernel benchmark (default 0.5)\n"
+			<< "      --seed <n>          seed for the random inputs (default 42)\n"
+			<< "      --no-full           skip timing the full computation\n"
+			<< "      --check <list>      compare the grid scan with the adaptive mode for the comma separated lMax values, instead of timing\n"
+			<< "  -j, --json <file>       write the results to a json file\n"
+			<< "  -h, --help              show this message\n";
+	}
+
+}
+
+int main(int argc, char* argv[])
+{
+	int nrPoints = 50;
+	std::vector<int> threads{ 1, 2, 4 };
+	double minTime = 0.5;
+	unsigned int seed = 42;
+	bool full = true;
+	std::string jsonFile;
+	std::vector<int> checkLMaxs;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+
+		if (arg == "-h" || arg == "--help")
+		{
+			PrintUsage(argv[0]);
+			return 0;
+		}
+		else if (arg == "--no-full")
+		{
+			full = false;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << arg << "\n";
+			PrintUsage(argv[0]);
+			return 1;
+		}
+
+		const std::string val = argv[++i];
+
+		try
+		{
+			if (arg == "-n" || arg == "--points") nrPoints = std::stoi(val);
+			else if (arg == "-t" || arg == "--threads") threads = ParseList(val);
+			else if (arg == "--time") minTime = std::stod(val);
+			else if (arg == "--seed") seed = static_cast<unsigned int>(std::stoul(val));
+			else if (arg == "-j" || arg == "--json") jsonFile = val;
+			else if (arg == "--check") checkLMaxs = ParseList(val);
+			else
+			{
+				std::cerr << "Unknown option " << arg << "\n";
+				PrintUsage(argv[0]);
+				return 1;
+			}
+		}
+		catch (...)
+		{
+			std::cerr << "Invalid value for " << arg << ": " << val << "\n";
+			return 1;
+		}
+	}
+
+	// the defaults used by BandStructure::Compute, for Cu
+	const std::vector<std::string> path{ "G", "X", "W", "L", "G", "K" };
+
+	if (!checkLMaxs.empty())
+		return CheckLMax(path, nrPoints, checkLMaxs) ? 0 : 1;
+
+	constexpr int lMax = 2;
+	const ComputeOptions defaultOptions;
+	const int numerovIntervals = 2000;
+	const int numerovGridNodes = numerovIntervals + 1;
+	const double deltaGrid = 0.005;
+
+	KKR::BandStructure bandStructure;
+	bandStructure.Initialize(path, 400);
+
+	const auto& kpoints = bandStructure.GetKPoints();
+	const double Rmax = bandStructure.GetRmax();
+	const KKR::RadialGrid grid(Rmax, deltaGrid, numerovGridNodes);
+
+	KKR::Potential potential;
+	KKR::BandStructure::SetPotential(potential, grid);
+	KKR::Numerov<KKR::NumerovFunctionNonUniformGrid> numerov(potential, grid);
+
+	KKR::Lambda lambda(bandStructure.GetBasisLattice(), bandStructure.GetRealLattice(), bandStructure.GetRealHarmonics(), Rmax, bandStructure.GetCellVolume(), bandStructure.GetEwaldParameters(), lMax);
+
+	// random inputs, generated with a fixed seed so the runs are comparable
+	const size_t nrInputs = 256;
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> energyDist(defaultOptions.minE, defaultOptions.maxE);
+	std::uniform_int_distribution<size_t> kDist(0, kpoints.size() - 1);
+	std::uniform_int_distribution<int> lDist(0, lMax);
+	std::uniform_int_distribution<int> LDist(0, 2 * lMax);
+
+	std::vector<double> energies(nrInputs);
+	std::vector<size_t> kIndices(nrInputs);
+	std::vector<int> ls(nrInputs);
+	std::vector<int> Ls(nrInputs);
+	std::vector<int> Ms(nrInputs);
+	for (size_t i = 0; i < nrInputs; ++i)
+	{
+		energies[i] = energyDist(rng);
+		kIndices[i] = kDist(rng);
+		ls[i] = lDist(rng);
+		Ls[i] = LDist(rng);
+		Ms[i] = std::uniform_int_distribution<int>(-Ls[i], Ls[i])(rng);
+	}
+
+	std::vector<std::vector<double>> ratios(nrInputs, std::vector<double>(lMax + 1LL));
+	std::vector<KKR::EwaldEnergyTerms> energyTerms(nrInputs);
+	for (size_t i = 0; i < nrInputs; ++i)
+	{
+		for (int l = 0; l <= lMax; ++l)
+			ratios[i][l] = numerov.SolveSchrodinger(numerovIntervals, l, energies[i], numerovIntervals);
+
+		energyTerms[i] = lambda.ComputeEnergyTerms(energies[i]);
+	}
+
+	std::vector<BenchmarkResult> results;
+
+	results.emplace_back(Run("Numerov::SolveSchrodinger", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			sink = numerov.SolveSchrodinger(numerovIntervals, ls[ind], energies[ind], numerovIntervals);
+		}));
+	Print(results.back());
+
+	std::vector<double> allRatios(lMax + 1LL);
+	results.emplace_back(Run("Numerov::SolveSchrodingerForAllL", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			numerov.SolveSchrodingerForAllL(numerovIntervals, lMax, energies[ind], numerovIntervals, allRatios);
+			sink = allRatios[0];
+		}));
+	Print(results.back());
+
+	KKR::LogDerivativeNumerov<KKR::NumerovFunctionNonUniformGrid> logDerivativeNumerov(potential, grid);
+	results.emplace_back(Run("LogDerivativeNumerov::SolveSchrodingerForAllL", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			logDerivativeNumerov.SolveSchrodingerForAllL(numerovIntervals, lMax, energies[ind], numerovIntervals, allRatios);
+			sink = allRatios[0];
+		}));
+	Print(results.back());
+
+	KKR::PhaseShiftTable phaseShiftTable;
+	results.emplace_back(Run("PhaseShiftTable::Compute", minTime, [&](long long int i)
+		{
+			phaseShiftTable.Compute(numerov, numerovIntervals, Rmax, static_cast<unsigned int>(i % (lMax + 1LL)), defaultOptions.minE, defaultOptions.maxE, 0.02, 0.01 * defaultOptions.tolerance);
+			sink = static_cast<double>(phaseShiftTable.GetSize());
+		}));
+	Print(results.back());
+
+	phaseShiftTable.Compute(numerov, numerovIntervals, Rmax, lMax, defaultOptions.minE, defaultOptions.maxE, 0.02, 0.01 * defaultOptions.tolerance);
+	results.emplace_back(Run("PhaseShiftTable::GetRatio", minTime, [&](long long int i)
+		{
+			double derivative;
+			sink = phaseShiftTable.GetRatio(energies[i % nrInputs], derivative);
+		}));
+	Print(results.back());
+
+	// the time is for a batch of energies, the way the energy grid is solved
+	constexpr size_t batchSize = 4;
+	std::vector<std::vector<double>> batchRatios(batchSize);
+	results.emplace_back(Run("Numerov::SolveSchrodingerBatch x4", minTime, [&](long long int i)
+		{
+			const size_t ind = i % (nrInputs - batchSize);
+			numerov.SolveSchrodingerBatch(numerovIntervals, lMax, &energies[ind], batchSize, numerovIntervals, batchRatios.data());
+			sink = batchRatios[0][0];
+		}));
+	Print(results.back());
+
+	results.emplace_back(Run("Lambda::ComputeEnergyTerms", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			sink = lambda.ComputeEnergyTerms(energies[ind]).D3;
+		}));
+	Print(results.back());
+
+	results.emplace_back(Run("Lambda::SetKPoint", minTime, [&](long long int i)
+		{
+			lambda.SetKPoint(kpoints[kIndices[i % nrInputs]]);
+		}));
+	Print(results.back());
+
+	// as in the band structure computation, the k point is fixed while the energy changes
+	// so the following do not include the time spent in SetKPoint
+	lambda.SetKPoint(kpoints[kIndices[0]]);
+	results.emplace_back(Run("Lambda::D", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			sink = lambda.D(energies[ind], Ls[ind], Ms[ind], energyTerms[ind]).real();
+		}));
+	Print(results.back());
+
+	results.emplace_back(Run("Lambda::ComputeDmap", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			lambda.ComputeDmap(energies[ind], kpoints[kIndices[0]], energyTerms[ind]);
+			sink = lambda.GetD(0, 0).real();
+		}));
+	Print(results.back());
+
+	results.emplace_back(Run("Lambda::Compute", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			lambda.Compute(energies[ind], kpoints[kIndices[0]], ratios[ind], energyTerms[ind]);
+		}));
+	Print(results.back());
+
+	// as in the energy major scan, several k points with their terms computed before, for each energy
+	const size_t nrKTerms = 4;
+	std::vector<KKR::EwaldKPointTerms> kTerms;
+	for (size_t i = 0; i < nrKTerms; ++i)
+		kTerms.emplace_back(lambda.ComputeKPointTerms(kpoints[kIndices[i]]));
+
+	results.emplace_back(Run("Lambda::Compute k point terms", minTime, [&](long long int i)
+		{
+			const size_t ind = (i / nrKTerms) % nrInputs;
+			lambda.Compute(energies[ind], kTerms[i % nrKTerms], ratios[ind], energyTerms[ind]);
+		}));
+	Print(results.back());
+
+	lambda.Compute(energies[0], kpoints[kIndices[0]], ratios[0]);
+	results.emplace_back(Run("Lambda::Determinant", minTime, [&](long long int /*i*/)
+		{
+			sink = lambda.Determinant();
+		}));
+	Print(results.back());
+
+	// the energy derivatives used by the Newton steps, they include the energy terms, computed with the derivatives
+	std::vector<std::vector<double>> ratioDerivatives(nrInputs, std::vector<double>(lMax + 1LL));
+	for (size_t i = 0; i < nrInputs; ++i)
+		for (int l = 0; l <= lMax; ++l)
+			numerov.SolveSchrodinger(numerovIntervals, l, energies[i], numerovIntervals, ratioDerivatives[i][l]);
+
+	results.emplace_back(Run("Numerov::SolveSchrodinger derivative", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			double derivative;
+			sink = numerov.SolveSchrodinger(numerovIntervals, ls[ind], energies[ind], numerovIntervals, derivative);
+		}));
+	Print(results.back());
+
+	results.emplace_back(Run("Lambda::ComputeWithDerivative", minTime, [&](long long int i)
+		{
+			const size_t ind = i % nrInputs;
+			lambda.ComputeWithDerivative(energies[ind], kpoints[kIndices[0]], ratios[ind], ratioDerivatives[ind]);
+		}));
+	Print(results.back());
+
+	lambda.ComputeWithDerivative(energies[0], kpoints[kIndices[0]], ratios[0], ratioDerivatives[0]);
+	lambda.LogDet();
+	results.emplace_back(Run("Lambda::LogDetDerivative", minTime, [&](long long int /*i*/)
+		{
+			sink = lambda.LogDetDerivative();
+		}));
+	Print(results.back());
+
+	lambda.Compute(energies[0], kpoints[kIndices[0]], ratios[0]);
+	results.emplace_back(Run("Lambda::Eigenvalues", minTime, [&](long long int /*i*/)
+		{
+			sink = lambda.Eigenvalues()(0);
+		}));
+	Print(results.back());
+
+	if (full)
+	{
+		bandStructure.Initialize(path, nrPoints);
+
+		for (const int nrThreads : threads)
+		{
+			if (nrThreads < 1) continue;
+
+			// the grid scan, the adaptive scan, the eigenvalue tracking, the grid scan with Newton steps
+			// the eigenvalue tracking with the interpolated phase shifts and the grid scan going over the k points for each energy
+			const char* names[] = { "BandStructure::Compute", "BandStructure::Compute adaptive", "BandStructure::Compute tracking", "BandStructure::Compute newton", "BandStructure::Compute tracking table", "BandStructure::Compute energy major" };
+			for (int mode = 0; mode < 6; ++mode)
+			{
+				ComputeOptions options;
+				options.nrThreads = nrThreads;
+				options.adaptive = 1 == mode;
+				options.tracking = 2 == mode || 4 == mode;
+				options.newton = 3 == mode;
+				options.phaseShiftTable = 4 == mode;
+				options.energyMajor = 5 == mode;
+
+				const std::atomic_bool terminate(false);
+
+				BenchmarkResult res;
+				res.name = names[mode];
+				res.threads = nrThreads;
+
+				const auto start = std::chrono::steady_clock::now();
+				const auto bands = bandStructure.Compute(terminate, options);
+				res.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				res.calls = 1;
+				sink = static_cast<double>(bands.size());
+
+				results.push_back(res);
+				Print(res);
+			}
+		}
+	}
+
+	if (!jsonFile.empty())
+		WriteJson(jsonFile, results, seed, nrPoints);
+
+	return 0;
+}